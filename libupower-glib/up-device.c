@@ -90,6 +90,10 @@ enum {
 	PROP_BATTERY_LEVEL,
 	PROP_ICON_NAME,
 	PROP_CHARGE_CYCLES,
+	PROP_TIME_TO_EMPTY_MIN,
+	PROP_TIME_TO_EMPTY_MAX,
+	PROP_TIME_TO_FULL_MIN,
+	PROP_TIME_TO_FULL_MAX,
 	PROP_LAST
 };
 
@@ -364,11 +368,23 @@ up_device_to_text (UpDevice *device)
 			g_string_append_printf (string, "    time to full:        %s\n", time_str);
 			g_free (time_str);
 		}
+		if (up_exported_device_get_time_to_full_min (priv->proxy_device) > 0 &&
+		    up_exported_device_get_time_to_full_max (priv->proxy_device) > 0) {
+			g_autofree gchar *min_str = up_device_to_text_time_to_string (up_exported_device_get_time_to_full_min (priv->proxy_device));
+			g_autofree gchar *max_str = up_device_to_text_time_to_string (up_exported_device_get_time_to_full_max (priv->proxy_device));
+			g_string_append_printf (string, "    time to full range:  %s - %s\n", min_str, max_str);
+		}
 		if (up_exported_device_get_time_to_empty (priv->proxy_device) > 0) {
 			time_str = up_device_to_text_time_to_string (up_exported_device_get_time_to_empty (priv->proxy_device));
 			g_string_append_printf (string, "    time to empty:       %s\n", time_str);
 			g_free (time_str);
 		}
+		if (up_exported_device_get_time_to_empty_min (priv->proxy_device) > 0 &&
+		    up_exported_device_get_time_to_empty_max (priv->proxy_device) > 0) {
+			g_autofree gchar *min_str = up_device_to_text_time_to_string (up_exported_device_get_time_to_empty_min (priv->proxy_device));
+			g_autofree gchar *max_str = up_device_to_text_time_to_string (up_exported_device_get_time_to_empty_max (priv->proxy_device));
+			g_string_append_printf (string, "    time to empty range: %s - %s\n", min_str, max_str);
+		}
 	}
 	if (kind != UP_DEVICE_KIND_LINE_POWER ||
 	    kind >= UP_DEVICE_KIND_LAST) {
@@ -424,6 +440,47 @@ up_device_refresh_sync (UpDevice *device, GCancellable *cancellable, GError **er
 	return up_exported_device_call_refresh_sync (device->priv->proxy_device, cancellable, error);
 }
 
+/*
+ * up_device_history_items_from_variant:
+ */
+static GPtrArray *
+up_device_history_items_from_variant (GVariant *gva)
+{
+	GPtrArray *array;
+	GVariantIter iter;
+	gdouble value;
+	guint32 time, state;
+
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	g_variant_iter_init (&iter, gva);
+	while (g_variant_iter_next (&iter, "(udu)", &time, &value, &state)) {
+		UpHistoryItem *obj;
+
+		obj = up_history_item_new ();
+		up_history_item_set_time (obj, time);
+		up_history_item_set_value (obj, value);
+		up_history_item_set_state (obj, state);
+		g_ptr_array_add (array, obj);
+	}
+	return array;
+}
+
+/*
+ * up_device_history_from_variant:
+ */
+static GPtrArray *
+up_device_history_from_variant (GVariant *gva, GError **error)
+{
+	/* no data */
+	if (g_variant_n_children (gva) == 0) {
+		g_set_error_literal (error, 1, 0, "no data");
+		return NULL;
+	}
+
+	/* convert */
+	return up_device_history_items_from_variant (gva);
+}
+
 /**
  * up_device_get_history_sync:
  * @device: a #UpDevice instance.
@@ -446,11 +503,8 @@ up_device_get_history_sync (UpDevice *device, const gchar *type, guint timespec,
 {
 	GError *error_local = NULL;
 	GVariant *gva = NULL;
-	guint i;
 	GPtrArray *array = NULL;
 	gboolean ret;
-	gsize len;
-	GVariantIter *iter;
 
 	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
 	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
@@ -470,43 +524,188 @@ up_device_get_history_sync (UpDevice *device, const gchar *type, guint timespec,
 		goto out;
 	}
 
-	iter = g_variant_iter_new (gva);
-	len = g_variant_iter_n_children (iter);
-
-	/* no data */
-	if (len == 0) {
-		g_set_error_literal (error, 1, 0, "no data");
-		g_variant_iter_free (iter);
-		goto out;
-	}
+	array = up_device_history_from_variant (gva, error);
 
-	/* convert */
-	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	for (i = 0; i < len; i++) {
-		UpHistoryItem *obj;
-		GVariant *v;
-		gdouble value;
-		guint32 time, state;
+out:
+	g_clear_pointer (&gva, g_variant_unref);
+	return array;
+}
 
-		v = g_variant_iter_next_value (iter);
-		g_variant_get (v, "(udu)",
-			       &time, &value, &state);
-		g_variant_unref (v);
+/**
+ * up_device_get_history_downsampled_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate" and "charge".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the resolution of data.
+ * @mode: how the data is reduced, known values are "average", "lttb" and "minmax".
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets the device history like up_device_get_history_sync(), but reduces
+ * it to @resolution points in a way that keeps short peaks visible.
+ *
+ * Return value: (element-type UpHistoryItem) (transfer full): an array of #UpHistoryItem's, with the most
+ *               recent one being first; %NULL if @error is set or @device is
+ *               invalid
+ *
+ * Since: 1.90.2
+ **/
+GPtrArray *
+up_device_get_history_downsampled_sync (UpDevice *device, const gchar *type, guint timespec, guint resolution,
+					const gchar *mode, GCancellable *cancellable, GError **error)
+{
+	GError *error_local = NULL;
+	GVariant *gva = NULL;
+	GPtrArray *array = NULL;
+	gboolean ret;
 
-		obj = up_history_item_new ();
-		up_history_item_set_time (obj, time);
-		up_history_item_set_value (obj, value);
-		up_history_item_set_state (obj, state);
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
 
-		g_ptr_array_add (array, obj);
+	ret = up_exported_device_call_get_history_downsampled_sync (device->priv->proxy_device,
+								    type,
+								    timespec,
+								    resolution,
+								    mode,
+								    &gva,
+								    cancellable,
+								    &error_local);
+	if (!ret) {
+		g_set_error (error, 1, 0, "GetHistoryDownsampled(%s,%i,%s) on %s failed: %s", type, timespec,
+			     mode, up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		goto out;
 	}
-	g_variant_iter_free (iter);
+
+	array = up_device_history_from_variant (gva, error);
 
 out:
 	g_clear_pointer (&gva, g_variant_unref);
 	return array;
 }
 
+typedef struct {
+	gchar		**types;
+	guint		  timespec;
+	guint		  resolution;
+} UpDeviceHistoryMultiData;
+
+static void
+up_device_history_multi_data_free (UpDeviceHistoryMultiData *data)
+{
+	g_strfreev (data->types);
+	g_free (data);
+}
+
+static void
+get_history_multi_async_thread (GTask        *task,
+				gpointer      source_object,
+				gpointer      task_data,
+				GCancellable *cancellable)
+{
+	UpDevice *device = UP_DEVICE (source_object);
+	UpDeviceHistoryMultiData *data = task_data;
+	GError *error = NULL;
+	GVariant *gva = NULL;
+	GVariantIter iter;
+	GHashTable *hash;
+	const gchar *type;
+	GVariant *value;
+
+	if (!up_exported_device_call_get_history_multi_sync (device->priv->proxy_device,
+							     (const gchar * const *) data->types,
+							     data->timespec,
+							     data->resolution,
+							     &gva,
+							     cancellable,
+							     &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+
+	hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+				      (GDestroyNotify) g_ptr_array_unref);
+	g_variant_iter_init (&iter, gva);
+	while (g_variant_iter_next (&iter, "{&s@a(udu)}", &type, &value)) {
+		g_hash_table_insert (hash, g_strdup (type),
+				     up_device_history_items_from_variant (value));
+		g_variant_unref (value);
+	}
+	g_variant_unref (gva);
+	g_task_return_pointer (task, hash, (GDestroyNotify) g_hash_table_unref);
+}
+
+/**
+ * up_device_get_history_multi_async:
+ * @device: a #UpDevice instance.
+ * @types: (array zero-terminated=1): the types of history, known values
+ *     are "rate", "charge", "time-full" and "time-empty".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the resolution of data.
+ * @cancellable: (nullable): a #GCancellable or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronously gets several types of device history in one request. The
+ * points of all types are spread over the same time range.
+ *
+ * Since: 1.90.2
+ **/
+void
+up_device_get_history_multi_async (UpDevice            *device,
+				   const gchar * const *types,
+				   guint                timespec,
+				   guint                resolution,
+				   GCancellable        *cancellable,
+				   GAsyncReadyCallback  callback,
+				   gpointer             user_data)
+{
+	g_autoptr(GTask) task = NULL;
+	UpDeviceHistoryMultiData *data;
+
+	g_return_if_fail (UP_IS_DEVICE (device));
+	g_return_if_fail (device->priv->proxy_device != NULL);
+	g_return_if_fail (types != NULL);
+
+	data = g_new0 (UpDeviceHistoryMultiData, 1);
+	data->types = g_strdupv ((gchar **) types);
+	data->timespec = timespec;
+	data->resolution = resolution;
+
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_source_tag (task, (gpointer) G_STRFUNC);
+	g_task_set_task_data (task, data, (GDestroyNotify) up_device_history_multi_data_free);
+
+	g_task_run_in_thread (task, get_history_multi_async_thread);
+}
+
+/**
+ * up_device_get_history_multi_finish:
+ * @device: a #UpDevice instance.
+ * @res: a #GAsyncResult obtained from the #GAsyncReadyCallback passed
+ *     to up_device_get_history_multi_async()
+ * @error: a #GError, or %NULL.
+ *
+ * Finishes an operation started with up_device_get_history_multi_async().
+ *
+ * Return value: (element-type utf8 GPtrArray) (transfer full): a table
+ *     mapping each requested type to an array of #UpHistoryItem's, with
+ *     the most recent one being first, or %NULL on error.
+ *
+ * Since: 1.90.2
+ **/
+GHashTable *
+up_device_get_history_multi_finish (UpDevice      *device,
+				    GAsyncResult  *res,
+				    GError       **error)
+{
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (g_task_is_valid (res, device), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
 /**
  * up_device_get_statistics_sync:
  * @device: a #UpDevice instance.
@@ -671,6 +870,18 @@ up_device_set_property (GObject *object, guint prop_id, const GValue *value, GPa
 	case PROP_TIME_TO_FULL:
 		up_exported_device_set_time_to_full (device->priv->proxy_device, g_value_get_int64 (value));
 		break;
+	case PROP_TIME_TO_EMPTY_MIN:
+		up_exported_device_set_time_to_empty_min (device->priv->proxy_device, g_value_get_int64 (value));
+		break;
+	case PROP_TIME_TO_EMPTY_MAX:
+		up_exported_device_set_time_to_empty_max (device->priv->proxy_device, g_value_get_int64 (value));
+		break;
+	case PROP_TIME_TO_FULL_MIN:
+		up_exported_device_set_time_to_full_min (device->priv->proxy_device, g_value_get_int64 (value));
+		break;
+	case PROP_TIME_TO_FULL_MAX:
+		up_exported_device_set_time_to_full_max (device->priv->proxy_device, g_value_get_int64 (value));
+		break;
 	case PROP_PERCENTAGE:
 		up_exported_device_set_percentage (device->priv->proxy_device, g_value_get_double (value));
 		break;
@@ -791,6 +1002,18 @@ up_device_get_property (GObject *object, guint prop_id, GValue *value, GParamSpe
 	case PROP_TIME_TO_FULL:
 		g_value_set_int64 (value, up_exported_device_get_time_to_full (device->priv->proxy_device));
 		break;
+	case PROP_TIME_TO_EMPTY_MIN:
+		g_value_set_int64 (value, up_exported_device_get_time_to_empty_min (device->priv->proxy_device));
+		break;
+	case PROP_TIME_TO_EMPTY_MAX:
+		g_value_set_int64 (value, up_exported_device_get_time_to_empty_max (device->priv->proxy_device));
+		break;
+	case PROP_TIME_TO_FULL_MIN:
+		g_value_set_int64 (value, up_exported_device_get_time_to_full_min (device->priv->proxy_device));
+		break;
+	case PROP_TIME_TO_FULL_MAX:
+		g_value_set_int64 (value, up_exported_device_get_time_to_full_max (device->priv->proxy_device));
+		break;
 	case PROP_PERCENTAGE:
 		g_value_set_double (value, up_exported_device_get_percentage (device->priv->proxy_device));
 		break;
@@ -1139,6 +1362,54 @@ up_device_class_init (UpDeviceClass *klass)
 					 g_param_spec_int64 ("time-to-full", NULL, NULL,
 							      0, G_MAXINT64, 0,
 							      G_PARAM_READWRITE));
+	/**
+	 * UpDevice:time-to-empty-min:
+	 *
+	 * The lower bound of the amount of time until the device is empty.
+	 *
+	 * Since: 1.90.2
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_TIME_TO_EMPTY_MIN,
+					 g_param_spec_int64 ("time-to-empty-min", NULL, NULL,
+							      0, G_MAXINT64, 0,
+							      G_PARAM_READWRITE));
+	/**
+	 * UpDevice:time-to-empty-max:
+	 *
+	 * The upper bound of the amount of time until the device is empty.
+	 *
+	 * Since: 1.90.2
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_TIME_TO_EMPTY_MAX,
+					 g_param_spec_int64 ("time-to-empty-max", NULL, NULL,
+							      0, G_MAXINT64, 0,
+							      G_PARAM_READWRITE));
+	/**
+	 * UpDevice:time-to-full-min:
+	 *
+	 * The lower bound of the amount of time until the device is fully charged.
+	 *
+	 * Since: 1.90.2
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_TIME_TO_FULL_MIN,
+					 g_param_spec_int64 ("time-to-full-min", NULL, NULL,
+							      0, G_MAXINT64, 0,
+							      G_PARAM_READWRITE));
+	/**
+	 * UpDevice:time-to-full-max:
+	 *
+	 * The upper bound of the amount of time until the device is fully charged.
+	 *
+	 * Since: 1.90.2
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_TIME_TO_FULL_MAX,
+					 g_param_spec_int64 ("time-to-full-max", NULL, NULL,
+							      0, G_MAXINT64, 0,
+							      G_PARAM_READWRITE));
 	/**
 	 * UpDevice:percentage:
 	 *
@@ -83,6 +83,23 @@ GPtrArray	*up_device_get_history_sync		(UpDevice		*device,
 							 guint			 resolution,
 							 GCancellable		*cancellable,
 							 GError			**error);
+GPtrArray	*up_device_get_history_downsampled_sync	(UpDevice		*device,
+							 const gchar		*type,
+							 guint			 timespec,
+							 guint			 resolution,
+							 const gchar		*mode,
+							 GCancellable		*cancellable,
+							 GError			**error);
+void		 up_device_get_history_multi_async	(UpDevice		*device,
+							 const gchar * const	*types,
+							 guint			 timespec,
+							 guint			 resolution,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+GHashTable	*up_device_get_history_multi_finish	(UpDevice		*device,
+							 GAsyncResult		*res,
+							 GError			**error);
 GPtrArray	*up_device_get_statistics_sync		(UpDevice		*device,
 							 const gchar		*type,
 							 GCancellable		*cancellable,
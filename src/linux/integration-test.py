@@ -1017,6 +1017,63 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(self.get_dbus_dev_property(bat0_up, 'EnergyRate'), 0.0)
         self.stop_daemon()
 
+    def test_battery_time_bounds(self):
+        '''Battery time estimate with confidence bounds'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '48000000',
+                                 'voltage_now', '12000000',
+                                 'power_now', '10000000'], [])
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        time_to_empty = self.get_dbus_dev_property(bat0_up, 'TimeToEmpty')
+        self.assertEqual(time_to_empty, 17280)
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, 'TimeToEmptyMin'), 0)
+        self.assertLess(self.get_dbus_dev_property(bat0_up, 'TimeToEmptyMin'), time_to_empty)
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, 'TimeToEmptyMax'), time_to_empty)
+        self.assertEqual(self.get_dbus_dev_property(bat0_up, 'TimeToFullMin'), 0)
+        self.assertEqual(self.get_dbus_dev_property(bat0_up, 'TimeToFullMax'), 0)
+        self.stop_daemon()
+
+    def test_battery_charge_threshold(self):
+        '''Time to full with a charge end threshold'''
+
+        bat0 = self.testbed.add_device('power_supply', 'BAT0', None,
+                                       ['type', 'Battery',
+                                        'present', '1',
+                                        'status', 'Charging',
+                                        'energy_full', '60000000',
+                                        'energy_full_design', '80000000',
+                                        'energy_now', '30000000',
+                                        'voltage_now', '12000000',
+                                        'power_now', '10000000',
+                                        'charge_control_end_threshold', '80'], [])
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        # 10 points at 10 W, then tapering off over the 20 points up to 80%
+        time_to_full = self.get_dbus_dev_property(bat0_up, 'TimeToFull')
+        self.assertAlmostEqual(time_to_full, 10145, delta=1)
+
+        # the threshold is re-read on uevents
+        self.testbed.set_attribute(bat0, 'charge_control_end_threshold', '100')
+        self.testbed.uevent(bat0, 'change')
+        time.sleep(1)
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, 'TimeToFull'), time_to_full)
+        self.stop_daemon()
+
     def test_ups_no_ac(self):
         '''UPS properties without AC'''
 
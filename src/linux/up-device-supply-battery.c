@@ -47,6 +47,7 @@ enum {
 
 struct _UpDeviceSupplyBattery
 {
+	UpDeviceBattery		 parent;
 	gboolean		 has_coldplug_values;
 	gboolean		 coldplug_units;
 	gdouble			*energy_old;
@@ -55,6 +56,9 @@ struct _UpDeviceSupplyBattery
 	gdouble			 rate_old;
 	gboolean		 shown_invalid_voltage_warning;
 	gboolean		 ignore_system_percentage;
+	/* charge end threshold in percent, only re-read on uevents */
+	gboolean		 has_charge_end_threshold;
+	gint			 charge_end_threshold;
 };
 
 G_DEFINE_TYPE (UpDeviceSupplyBattery, up_device_supply_battery, UP_TYPE_DEVICE_BATTERY)
@@ -127,6 +131,33 @@ get_sysfs_attr_uncached (GUdevDevice *native, const gchar *key)
 	return g_steal_pointer (&value);
 }
 
+/**
+ * up_device_supply_battery_update_end_threshold:
+ *
+ * The charge end threshold is configuration rather than a measurement, so
+ * it is only read when the battery is added and when a uevent arrives, not
+ * on every poll.
+ **/
+static void
+up_device_supply_battery_update_end_threshold (UpDeviceSupplyBattery *self,
+					       GUdevDevice *native,
+					       UpRefreshReason reason)
+{
+	gint threshold = 0;
+
+	if (self->has_charge_end_threshold &&
+	    reason != UP_REFRESH_INIT &&
+	    reason != UP_REFRESH_EVENT)
+		return;
+
+	if (g_udev_device_has_sysfs_attr (native, "charge_control_end_threshold"))
+		threshold = g_udev_device_get_sysfs_attr_as_int_uncached (native, "charge_control_end_threshold");
+
+	/* 0 means charging is not limited */
+	self->charge_end_threshold = threshold > 0 && threshold <= 100 ? threshold : 0;
+	self->has_charge_end_threshold = TRUE;
+}
+
 static gboolean
 up_device_supply_battery_refresh (UpDevice *device,
 				  UpRefreshReason reason)
@@ -172,6 +203,9 @@ up_device_supply_battery_refresh (UpDevice *device,
 	}
 	info.technology = up_convert_device_technology (get_sysfs_attr_uncached (native, "technology"));
 
+	up_device_supply_battery_update_end_threshold (self, native, reason);
+	info.charge_end_threshold = self->charge_end_threshold;
+
 	/* NOTE: We used to warn about full > design, but really that is prefectly fine to happen. */
 
 	/* Update the battery information (will only fire events for actual changes) */
@@ -34,6 +34,7 @@
 #include "up-device.h"
 #include "up-backend.h"
 #include "up-daemon.h"
+#include "up-history-writer.h"
 
 struct UpDaemonPrivate
 {
@@ -624,6 +625,13 @@ up_daemon_set_on_battery (UpDaemon *daemon, gboolean on_battery)
 static gboolean
 take_action_timeout_cb (UpDaemon *daemon)
 {
+	UpHistoryWriter *writer;
+
+	/* The journal of the history does not survive a power off */
+	writer = up_history_writer_new ();
+	up_history_writer_flush (writer);
+	g_object_unref (writer);
+
 	/* Release the inhibitor lock first, otherwise our action may be canceled */
 	if (daemon->priv->critical_action_lock_fd >= 0) {
 		close (daemon->priv->critical_action_lock_fd);
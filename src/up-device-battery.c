@@ -18,19 +18,53 @@
  *
  */
 
+#include <math.h>
 #include <string.h>
 
 #include "up-constants.h"
 #include "up-config.h"
 #include "up-device-battery.h"
 
-/* Chosen to be quite big, in case there was a lot of re-polling */
-#define MAX_ESTIMATION_POINTS 15
+/* The time over which the rate is fitted, if not configured */
+#define UP_BATTERY_DEFAULT_RATE_WINDOW		300	/* seconds */
+
+/* Tuning of the energy/rate filter, energy in Wh, rate in W, time in hours */
+#define UP_BATTERY_FILTER_ENERGY_NOISE		0.001	/* of energy_full, standard deviation */
+#define UP_BATTERY_FILTER_RATE_DRIFT		100.0	/* W² per hour */
+#define UP_BATTERY_FILTER_RATE_INITIAL_VAR	400.0	/* W² */
+#define UP_BATTERY_FILTER_MEASURED_RATE_VAR	1.0	/* W² */
+
+/* Only voltage readings at a low current are close to the open circuit
+ * voltage, the limit is a fraction of the capacity per hour (C-rate) */
+#define UP_BATTERY_OCV_MAX_CURRENT		0.1	/* of charge_full per hour */
+
+/* How often the full and design energy may follow the learned voltage */
+#define UP_BATTERY_VOLTAGE_FULL_INTERVAL	(24 * 60 * 60)	/* seconds */
+
+/* The charge rate drops before a charge end threshold, modelled as falling
+ * linearly over the last points before the threshold */
+#define UP_BATTERY_TAPER_WIDTH			20.0	/* percentage points */
+#define UP_BATTERY_TAPER_END_RATE		0.25	/* of the rate before tapering */
 
 typedef struct {
-	UpBatteryValues hw_data[MAX_ESTIMATION_POINTS];
-	gint hw_data_last;
-	gint hw_data_len;
+	gint64 ts_us;
+	gdouble energy;
+} UpBatterySample;
+
+typedef struct {
+	/* The energy readings within the rate window, oldest first from
+	 * window_start, with running sums for a least squares fit. The
+	 * times are in hours since window_origin. */
+	GArray *window;
+	guint window_start;
+	gint64 window_us;
+	gint64 window_origin;
+	UpDeviceState window_state;
+	gdouble sum_t;
+	gdouble sum_e;
+	gdouble sum_tt;
+	gdouble sum_te;
+	gdouble sum_ee;
 
 	gboolean present;
 	gboolean units_changed_warning;
@@ -44,11 +78,28 @@ typedef struct {
 	gdouble energy_full;
 	gdouble energy_full_reported;
 	gdouble energy_design;
+	gdouble energy_design_reported;
+	/* for batteries reporting charge, in Ah */
+	gdouble charge_full;
+	/* the mean voltage that energy_full and energy_design are based on,
+	 * and when it was last updated (0 if they are as reported) */
+	gdouble voltage_full;
+	gint64 voltage_full_ts_us;
 	gint charge_cycles;
+	/* in percent, 0 if charging is not limited */
+	gint charge_end_threshold;
 
 	gboolean trust_power_measurement;
 	gint64 last_power_discontinuity;
 
+	/* Kalman filter over the energy and its signed rate of change,
+	 * reset whenever filter_ts_us is zero */
+	gint64 filter_ts_us;
+	UpDeviceState filter_state;
+	gdouble filter_energy;
+	gdouble filter_rate;
+	gdouble filter_cov[2][2];
+
 	/* dynamic values */
 	gint64 fast_repoll_until;
 	gboolean repoll_needed;
@@ -85,69 +136,210 @@ up_device_battery_charge_to_energy (UpDeviceBattery *self, gdouble charge)
 	 *  - output current
 	 *  - temperature
 	 *  - charge
-	 * The easiest way to improve this would likely be "machine learning",
-	 * i.e. statistics through which we can calculate the actual
-	 * performance based on the factors we have.
+	 * This is only a first guess, see up_device_battery_convert_charge()
+	 * for how the readings are converted once the voltage is learned.
 	 */
 	return priv->voltage_design * charge;
 }
 
+/**
+ * up_device_battery_convert_charge:
+ *
+ * Converts charge readings to energy, using the mean voltage over the
+ * state of charge. The voltage is learned per state of charge and
+ * temperature in the history of the battery, from the voltage readings
+ * taken at a low current, and the design voltage is used where nothing
+ * is known yet.
+ **/
 static void
-up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
+up_device_battery_convert_charge (UpDeviceBattery *self, UpBatteryValues *values, UpRefreshReason reason)
 {
 	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
-	UpDeviceState reported_state;
-	UpBatteryValues *ref = NULL;
-	gdouble energy_rate = 0.0;
-	gint64 ref_td = 999 * G_USEC_PER_SEC; /* We need to be able to do math with this */
-	gint i;
+	UpHistory *history;
+	gdouble charge = values->charge.cur;
+	gdouble current = values->charge.rate;
+	gdouble voltage_full;
+	gdouble soc = values->percentage;
+
+	history = up_device_ensure_history (UP_DEVICE (self));
+	if (priv->charge_full > 0 && charge > 0)
+		soc = CLAMP (charge / priv->charge_full * 100.0, 0.0, 100.0);
+	if (priv->charge_full > 0 && current <= UP_BATTERY_OCV_MAX_CURRENT * priv->charge_full)
+		up_history_set_voltage_data (history, soc, values->temperature, values->voltage);
+
+	values->units = UP_BATTERY_UNIT_ENERGY;
+	values->energy.cur = charge * up_history_get_voltage (history, 0.0, soc, values->temperature,
+							      priv->voltage_design);
+	values->energy.rate = current * up_history_get_voltage (history, soc, soc, values->temperature,
+								priv->voltage_design);
+
+	/* Keep the full and design energy on the same scale, but only when
+	 * starting, when they were reported again, or rarely otherwise, and
+	 * only follow bigger changes so that the properties do not churn */
+	if (reason != UP_REFRESH_INIT &&
+	    priv->voltage_full_ts_us != 0 &&
+	    values->ts_us - priv->voltage_full_ts_us < (gint64) UP_BATTERY_VOLTAGE_FULL_INTERVAL * G_USEC_PER_SEC)
+		return;
+	priv->voltage_full_ts_us = values->ts_us;
+	voltage_full = up_history_get_voltage (history, 0.0, 100.0, values->temperature,
+					       priv->voltage_design);
+	if (fabs (voltage_full - priv->voltage_full) <= 0.005 * priv->voltage_full)
+		return;
+	priv->voltage_full = voltage_full;
+	priv->energy_full = priv->energy_full_reported / priv->voltage_design * voltage_full;
+	priv->energy_design = priv->energy_design_reported / priv->voltage_design * voltage_full;
+	g_object_set (self,
+		      "capacity", MIN (priv->energy_full / priv->energy_design * 100.0, 100),
+		      "energy-full", priv->energy_full,
+		      "energy-full-design", priv->energy_design,
+		      NULL);
+}
 
-	/* Same item, but it is copied in already. */
-	g_assert (cur->ts_us != priv->hw_data[priv->hw_data_last].ts_us);
-	reported_state = cur->state;
+/* The variance of an energy reading, in Wh² */
+static gdouble
+up_device_battery_get_energy_var (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gdouble energy_sd;
 
-	if (cur->state != UP_DEVICE_STATE_CHARGING &&
-	    cur->state != UP_DEVICE_STATE_DISCHARGING &&
-	    cur->state != UP_DEVICE_STATE_UNKNOWN)
-		return;
+	energy_sd = MAX (UP_BATTERY_FILTER_ENERGY_NOISE * priv->energy_full, 0.001);
+	return energy_sd * energy_sd;
+}
 
-	for (i = 0; i < priv->hw_data_len; i++) {
-		int pos = (priv->hw_data_last - i + G_N_ELEMENTS (priv->hw_data)) % G_N_ELEMENTS (priv->hw_data);
-		gint64 td;
+static void
+up_device_battery_window_clear_sums (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
 
-		/* Stop searching if the hardware state changed. */
-		if (priv->hw_data[pos].state != reported_state)
-			break;
+	priv->sum_t = 0.0;
+	priv->sum_e = 0.0;
+	priv->sum_tt = 0.0;
+	priv->sum_te = 0.0;
+	priv->sum_ee = 0.0;
+}
 
-		td = cur->ts_us - priv->hw_data[pos].ts_us;
-		/* At least 15 seconds worth of data. */
-		if (td < 15 * G_USEC_PER_SEC)
-			continue;
+static void
+up_device_battery_window_reset (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
 
-		/* Stop searching if the new reference is further away from the long timeout. */
-		if (ABS(UP_DAEMON_LONG_TIMEOUT * G_USEC_PER_SEC - ABS (td)) > ABS(UP_DAEMON_SHORT_TIMEOUT * G_USEC_PER_SEC - ref_td))
+	g_array_set_size (priv->window, 0);
+	priv->window_start = 0;
+	up_device_battery_window_clear_sums (self);
+}
+
+static void
+up_device_battery_window_sum (UpDeviceBattery *self, const UpBatterySample *sample, gdouble sign)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gdouble t = (sample->ts_us - priv->window_origin) / ((gdouble) 3600 * G_USEC_PER_SEC);
+
+	priv->sum_t += sign * t;
+	priv->sum_e += sign * sample->energy;
+	priv->sum_tt += sign * t * t;
+	priv->sum_te += sign * t * sample->energy;
+	priv->sum_ee += sign * sample->energy * sample->energy;
+}
+
+/**
+ * up_device_battery_window_add:
+ *
+ * Adds a reading to the rate window and drops the readings that fell out
+ * of it, updating the running sums. Each reading is added and dropped
+ * once, so this is O(1) amortized.
+ **/
+static void
+up_device_battery_window_add (UpDeviceBattery *self, const UpBatteryValues *cur)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpBatterySample sample = { cur->ts_us, cur->energy.cur };
+	guint i;
+
+	if (priv->window_state != cur->state)
+		up_device_battery_window_reset (self);
+	priv->window_state = cur->state;
+
+	while (priv->window_start < priv->window->len) {
+		const UpBatterySample *old = &g_array_index (priv->window, UpBatterySample, priv->window_start);
+
+		if (cur->ts_us - old->ts_us <= priv->window_us)
 			break;
+		up_device_battery_window_sum (self, old, -1.0);
+		priv->window_start++;
+	}
 
-		ref_td = td;
-		ref = &priv->hw_data[pos];
+	/* Drop the old readings once they take up half of the array, and
+	 * redo the sums from a new origin so that rounding errors from
+	 * the subtractions do not build up */
+	if (priv->window_start > 0 && priv->window_start * 2 >= priv->window->len) {
+		g_array_remove_range (priv->window, 0, priv->window_start);
+		priv->window_start = 0;
+		up_device_battery_window_clear_sums (self);
+		if (priv->window->len > 0)
+			priv->window_origin = g_array_index (priv->window, UpBatterySample, 0).ts_us;
+		for (i = 0; i < priv->window->len; i++)
+			up_device_battery_window_sum (self, &g_array_index (priv->window, UpBatterySample, i), 1.0);
 	}
+	if (priv->window->len == 0)
+		priv->window_origin = cur->ts_us;
+
+	g_array_append_val (priv->window, sample);
+	up_device_battery_window_sum (self, &sample, 1.0);
+}
+
+/**
+ * up_device_battery_estimate_power:
+ * @rate_var: (out): the variance of the estimated rate
+ *
+ * Estimates the rate from the energy readings, as the slope of a least
+ * squares fit over the rate window.
+ **/
+static void
+up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur, gdouble *rate_var)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	const UpBatterySample *first;
+	gdouble energy_rate = 0.0;
+	gdouble residual_var;
+	gdouble sxx;
+	gdouble sxy;
+	gdouble syy;
+	guint n;
+
+	up_device_battery_window_add (self, cur);
+
+	if (cur->state != UP_DEVICE_STATE_CHARGING &&
+	    cur->state != UP_DEVICE_STATE_DISCHARGING &&
+	    cur->state != UP_DEVICE_STATE_UNKNOWN)
+		return;
 
 	/* We rely solely on battery reports here, with dynamic power
 	 * usage (in particular during resume), lets just wait for a
 	 * bit longer before reporting anything to the user.
 	 *
-	 * Alternatively, we could assume that some old estimate for the
-	 * energy rate remains stable and do a time estimate based on that.
-	 *
-	 * For now, this is better than what we used to do.
+	 * At least 15 seconds worth of data are needed.
 	 */
-	if (!ref) {
+	n = priv->window->len - priv->window_start;
+	first = &g_array_index (priv->window, UpBatterySample, priv->window_start);
+	if (n < 2 || cur->ts_us - first->ts_us < 15 * G_USEC_PER_SEC) {
+		priv->repoll_needed = TRUE;
+		return;
+	}
+
+	/* energy is in Wh, time in h, so the slope is the rate in W */
+	sxx = priv->sum_tt - priv->sum_t * priv->sum_t / n;
+	sxy = priv->sum_te - priv->sum_t * priv->sum_e / n;
+	syy = priv->sum_ee - priv->sum_e * priv->sum_e / n;
+	if (sxx <= 0.0) {
 		priv->repoll_needed = TRUE;
 		return;
 	}
+	energy_rate = sxy / sxx;
 
-	/* energy is in Wh, rate in W */
-	energy_rate = (cur->energy.cur - ref->energy.cur) / (ref_td / ((gdouble) 3600 * G_USEC_PER_SEC));
+	/* The readings are quantized, so do not trust the fit to be better
+	 * than the noise of a reading */
+	residual_var = n > 2 ? MAX (syy - energy_rate * sxy, 0.0) / (n - 2) : 0.0;
+	*rate_var = MAX (residual_var, up_device_battery_get_energy_var (self)) / sxx;
 
 	/* Try to guess charge/discharge state based on rate.
 	 * Note that the history is discarded when the AC is plugged, as such
@@ -178,6 +370,168 @@ up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
 	cur->energy.rate = energy_rate;
 }
 
+/**
+ * up_device_battery_filter_update:
+ * @state: the state the hardware reported, before any guessing
+ * @rate: a signed rate measurement in W, or 0.0 if there is none
+ * @rate_var: the variance of @rate
+ *
+ * Runs one step of a Kalman filter over the energy and the rate at which
+ * it changes, modelling the rate as a random walk. Each step is O(1) and
+ * folds in the energy reading and, if available, a rate measurement.
+ *
+ * Return value: the standard deviation of the filtered rate, or a
+ *               negative value if the filter has no usable estimate
+ **/
+static gdouble
+up_device_battery_filter_update (UpDeviceBattery *self,
+				 UpBatteryValues *cur,
+				 UpDeviceState    state,
+				 gdouble          rate,
+				 gdouble          rate_var)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gdouble (*p)[2] = priv->filter_cov;
+	gdouble energy_var = up_device_battery_get_energy_var (self);
+	gdouble rate_sd;
+
+	if (priv->filter_ts_us == 0 || priv->filter_state != state) {
+		priv->filter_ts_us = cur->ts_us;
+		priv->filter_state = state;
+		priv->filter_energy = cur->energy.cur;
+		priv->filter_rate = rate;
+		p[0][0] = energy_var;
+		p[0][1] = p[1][0] = 0.0;
+		p[1][1] = rate_var > 0 ? rate_var : UP_BATTERY_FILTER_RATE_INITIAL_VAR;
+	} else {
+		gdouble dt = (cur->ts_us - priv->filter_ts_us) / ((gdouble) 3600 * G_USEC_PER_SEC);
+		gdouble q = UP_BATTERY_FILTER_RATE_DRIFT;
+		gdouble s, k0, k1, y;
+
+		/* predict */
+		priv->filter_ts_us = cur->ts_us;
+		priv->filter_energy += priv->filter_rate * dt;
+		p[0][0] += dt * (p[0][1] + p[1][0]) + dt * dt * p[1][1] + q * dt * dt * dt / 3;
+		p[0][1] += dt * p[1][1] + q * dt * dt / 2;
+		p[1][0] = p[0][1];
+		p[1][1] += q * dt;
+
+		/* energy measurement */
+		s = p[0][0] + energy_var;
+		k0 = p[0][0] / s;
+		k1 = p[1][0] / s;
+		y = cur->energy.cur - priv->filter_energy;
+		priv->filter_energy += k0 * y;
+		priv->filter_rate += k1 * y;
+		p[1][1] -= k1 * p[0][1];
+		p[1][0] -= k1 * p[0][0];
+		p[0][1] *= 1 - k0;
+		p[0][0] *= 1 - k0;
+
+		/* rate measurement */
+		if (rate_var > 0) {
+			s = p[1][1] + rate_var;
+			k0 = p[0][1] / s;
+			k1 = p[1][1] / s;
+			y = rate - priv->filter_rate;
+			priv->filter_energy += k0 * y;
+			priv->filter_rate += k1 * y;
+			p[0][0] -= k0 * p[1][0];
+			p[0][1] -= k0 * p[1][1];
+			p[1][0] *= 1 - k1;
+			p[1][1] *= 1 - k1;
+		}
+	}
+
+	/* Only use the estimate once the rate is clearly different from zero */
+	rate_sd = sqrt (p[1][1]);
+	if (2 * rate_sd >= ABS (priv->filter_rate))
+		return -1.0;
+	return rate_sd;
+}
+
+/**
+ * up_device_battery_get_charge_target:
+ *
+ * Return value: the percentage at which charging stops
+ **/
+static gdouble
+up_device_battery_get_charge_target (UpDeviceBattery *self)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+
+	if (priv->charge_end_threshold > 0 && priv->charge_end_threshold < 100)
+		return priv->charge_end_threshold;
+	return 100.0;
+}
+
+/**
+ * up_device_battery_get_time_to_full:
+ * @energy: the current energy in Wh
+ * @rate: the current charge rate in W
+ *
+ * Estimates the time until charging stops. With a charge end threshold,
+ * the rate is assumed to taper off towards the threshold.
+ *
+ * Return value: the time in seconds, or 0 if the target is reached
+ **/
+static gint64
+up_device_battery_get_time_to_full (UpDeviceBattery *self, gdouble energy, gdouble rate)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	gdouble target = up_device_battery_get_charge_target (self);
+	gdouble knee = target - UP_BATTERY_TAPER_WIDTH;
+	gdouble slope = (1.0 - UP_BATTERY_TAPER_END_RATE) / UP_BATTERY_TAPER_WIDTH;
+	gdouble soc;
+	gdouble factor = 1.0;
+	gdouble points = 0.0;
+
+	if (priv->energy_full <= 0)
+		return 0;
+	if (target >= 100.0)
+		return 3600 * (priv->energy_full - energy) / rate;
+
+	soc = 100.0 * energy / priv->energy_full;
+	if (soc >= target)
+		return 0;
+
+	if (soc < knee) {
+		points = knee - soc;
+		soc = knee;
+	} else {
+		/* already tapering, the rate before was higher */
+		factor = 1.0 - slope * (soc - knee);
+	}
+
+	/* the time spent per point grows with 1 / (1 - slope * (soc - knee)) */
+	points += log ((1.0 - slope * (soc - knee)) / (1.0 - slope * (target - knee))) / slope;
+
+	return 3600 * factor * points * priv->energy_full / 100.0 / rate;
+}
+
+/**
+ * up_device_battery_get_learned_time:
+ *
+ * Estimates the time to full or empty from how long each percentage point
+ * took in the past, as learned by the history of this battery. Unlike
+ * the rate, this does not need any recent measurements.
+ *
+ * Return value: the time in seconds, or 0 if unknown
+ **/
+static gint64
+up_device_battery_get_learned_time (UpDeviceBattery *self, UpBatteryValues *cur)
+{
+	UpHistory *history;
+
+	history = up_device_ensure_history (UP_DEVICE (self));
+	if (history == NULL)
+		return 0;
+	if (cur->state == UP_DEVICE_STATE_CHARGING)
+		return up_history_get_profile_time (history, TRUE, cur->percentage,
+						    up_device_battery_get_charge_target (self));
+	return up_history_get_profile_time (history, FALSE, 0.0, cur->percentage);
+}
+
 static void
 up_device_battery_update_poll_frequency (UpDeviceBattery *self,
 					 UpDeviceState    state,
@@ -231,8 +585,13 @@ up_device_battery_report (UpDeviceBattery *self,
 			  UpRefreshReason  reason)
 {
 	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpDeviceState reported_state;
 	gint64 time_to_empty = 0;
 	gint64 time_to_full = 0;
+	gint64 time_min = 0;
+	gint64 time_max = 0;
+	gdouble rate_var = 0.0;
+	gdouble rate_sd = -1.0;
 
 	if (!priv->present) {
 		g_warning ("Got a battery report for a battery that is not present");
@@ -244,12 +603,14 @@ up_device_battery_report (UpDeviceBattery *self,
 	values->ts_us = g_get_monotonic_time ();
 
 	/* Discard all old measurements that can't be used for estimations.
+	 * A state change resets the rate window as well.
 	 *
 	 * XXX: Should a state change also trigger an update of the timestamp
 	 *      that is used to discard power/current measurements?
 	 */
 	if (reason == UP_REFRESH_RESUME || reason == UP_REFRESH_LINE_POWER) {
-		priv->hw_data_len = 0;
+		up_device_battery_window_reset (self);
+		priv->filter_ts_us = 0;
 		priv->last_power_discontinuity = values->ts_us;
 	}
 
@@ -285,11 +646,8 @@ up_device_battery_report (UpDeviceBattery *self,
 		values->units = priv->units;
 	}
 
-	if (values->units == UP_BATTERY_UNIT_CHARGE) {
-		values->units = UP_BATTERY_UNIT_ENERGY;
-		values->energy.cur = up_device_battery_charge_to_energy (self, values->charge.cur);
-		values->energy.rate = up_device_battery_charge_to_energy (self, values->charge.rate);
-	}
+	if (values->units == UP_BATTERY_UNIT_CHARGE)
+		up_device_battery_convert_charge (self, values, reason);
 
 	/* QUIRK: Discard weird measurements (like a 300W power usage). */
 	if (values->energy.rate > 300)
@@ -335,33 +693,62 @@ up_device_battery_report (UpDeviceBattery *self,
 	if (values->energy.rate > 0.01)
 		priv->trust_power_measurement = TRUE;
 
+	reported_state = values->state;
 	if (priv->trust_power_measurement) {
 		/* QUIRK: Do not trust readings after a discontinuity happened */
 		if (priv->last_power_discontinuity + UP_DAEMON_DISTRUST_RATE_TIMEOUT * G_USEC_PER_SEC > values->ts_us)
 			values->energy.rate = 0.0;
+		rate_var = UP_BATTERY_FILTER_MEASURED_RATE_VAR;
 	} else {
-		up_device_battery_estimate_power (self, values);
+		up_device_battery_estimate_power (self, values, &rate_var);
 	}
 
+	/* Smooth the rate, both measured and estimated ones */
+	if (values->state == UP_DEVICE_STATE_CHARGING || values->state == UP_DEVICE_STATE_DISCHARGING) {
+		gdouble sign = values->state == UP_DEVICE_STATE_DISCHARGING ? -1.0 : 1.0;
+
+		if (values->energy.rate <= 0.01)
+			rate_var = 0.0;
+		rate_sd = up_device_battery_filter_update (self, values, reported_state,
+							   sign * values->energy.rate, rate_var);
+		if (rate_sd >= 0 && sign * priv->filter_rate > 0) {
+			values->energy.rate = sign * priv->filter_rate;
+			priv->repoll_needed = FALSE;
+		} else {
+			rate_sd = -1.0;
+		}
+	} else {
+		priv->filter_ts_us = 0;
+	}
+
+	if (values->energy.rate > 0.01 && values->state == UP_DEVICE_STATE_CHARGING) {
+		gdouble energy = values->energy.cur;
 
-	/* Push into our ring buffer */
-	priv->hw_data_last = (priv->hw_data_last + 1) % G_N_ELEMENTS (priv->hw_data);
-	priv->hw_data_len = MIN (priv->hw_data_len + 1, G_N_ELEMENTS (priv->hw_data));
-	priv->hw_data[priv->hw_data_last] = *values;
+		/* Roughly 95% confidence bounds from the filtered rate */
+		if (rate_sd >= 0) {
+			time_min = up_device_battery_get_time_to_full (self, energy, values->energy.rate + 2 * rate_sd);
+			/* the upper bound is unknown if the rate could be zero */
+			if (values->energy.rate - 2 * rate_sd > 0.01)
+				time_max = up_device_battery_get_time_to_full (self, energy, values->energy.rate - 2 * rate_sd);
+		}
+		time_to_full = up_device_battery_get_time_to_full (self, energy, values->energy.rate);
+	} else if (values->energy.rate > 0.01) {
+		gdouble energy = values->energy.cur;
+
+		if (rate_sd >= 0) {
+			time_min = 3600 * energy / (values->energy.rate + 2 * rate_sd);
+			if (values->energy.rate - 2 * rate_sd > 0.01)
+				time_max = 3600 * energy / (values->energy.rate - 2 * rate_sd);
+		}
+		time_to_empty = 3600 * energy / values->energy.rate;
+	} else if (values->state == UP_DEVICE_STATE_CHARGING || values->state == UP_DEVICE_STATE_DISCHARGING) {
+		priv->repoll_needed = TRUE;
 
-	if (values->energy.rate > 0.01) {
-		/* Calculate time to full/empty
-		 *
-		 * Here we could factor in collected data about charge rates
-		 * FIXME: Use charge-stop-threshold here
-		 */
+		/* No usable rate yet, e.g. right after resume or an AC change */
 		if (values->state == UP_DEVICE_STATE_CHARGING)
-			time_to_full = 3600 * (priv->energy_full - values->energy.cur) / values->energy.rate;
+			time_to_full = up_device_battery_get_learned_time (self, values);
 		else
-			time_to_empty = 3600 * values->energy.cur / values->energy.rate;
-	} else {
-		if (values->state == UP_DEVICE_STATE_CHARGING || values->state == UP_DEVICE_STATE_DISCHARGING)
-			priv->repoll_needed = TRUE;
+			time_to_empty = up_device_battery_get_learned_time (self, values);
 	}
 
 	/* QUIRK: Do a FULL/EMPTY guess if the state is still unknown
@@ -388,6 +775,10 @@ up_device_battery_report (UpDeviceBattery *self,
 		      "energy-rate", values->energy.rate,
 		      "time-to-empty", time_to_empty,
 		      "time-to-full", time_to_full,
+		      "time-to-empty-min", time_to_empty > 0 ? time_min : 0,
+		      "time-to-empty-max", time_to_empty > 0 ? time_max : 0,
+		      "time-to-full-min", time_to_full > 0 ? time_min : 0,
+		      "time-to-full-max", time_to_full > 0 ? time_max : 0,
 		      /* XXX: Move "update-time" updates elsewhere? */
 		      "update-time", (guint64) g_get_real_time () / G_USEC_PER_SEC,
 		      NULL);
@@ -458,7 +849,14 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 		}
 
 		priv->voltage_design = info->voltage_design;
+
+		if (priv->charge_end_threshold != info->charge_end_threshold) {
+			g_debug ("Charge end threshold changed to %i%%", info->charge_end_threshold);
+			priv->charge_end_threshold = info->charge_end_threshold;
+		}
+
 		if (priv->units == UP_BATTERY_UNIT_CHARGE) {
+			priv->charge_full = info->charge.full > 0.01 ? info->charge.full : info->charge.design;
 			energy_full = up_device_battery_charge_to_energy (self, info->charge.full);
 			energy_design = up_device_battery_charge_to_energy (self, info->charge.design);
 		} else {
@@ -472,10 +870,13 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 		/* Force -1 for unknown value (where 0 is also an unknown value) */
 		charge_cycles = info->charge_cycles > 0 ? info->charge_cycles : -1;
 
-		if (energy_full != priv->energy_full_reported || energy_design != priv->energy_design) {
+		if (energy_full != priv->energy_full_reported || energy_design != priv->energy_design_reported) {
 			priv->energy_full = energy_full;
 			priv->energy_full_reported = energy_full;
 			priv->energy_design = energy_design;
+			priv->energy_design_reported = energy_design;
+			priv->voltage_full = priv->voltage_design;
+			priv->voltage_full_ts_us = 0;
 
 			g_object_set (self,
 			              /* How healthy the battery is (clamp to 100% if it can hold more charge than expected) */
@@ -496,7 +897,8 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 	} else {
 		priv->present = FALSE;
 		priv->trust_power_measurement = FALSE;
-		priv->hw_data_len = 0;
+		up_device_battery_window_reset (self);
+		priv->filter_ts_us = 0;
 		priv->units = UP_BATTERY_UNIT_UNDEFINED;
 
 		g_object_set (self,
@@ -521,17 +923,37 @@ up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info)
 static void
 up_device_battery_init (UpDeviceBattery *self)
 {
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	g_autoptr(UpConfig) config = up_config_new ();
+
 	g_object_set (self,
 	              "type", UP_DEVICE_KIND_BATTERY,
 	              "power-supply", TRUE,
 	              "is-rechargeable", TRUE,
 	              NULL);
+
+	priv->window = g_array_new (FALSE, FALSE, sizeof (UpBatterySample));
+	priv->window_us = up_config_get_uint (config, "RateEstimationWindow") * G_USEC_PER_SEC;
+	if (priv->window_us == 0)
+		priv->window_us = UP_BATTERY_DEFAULT_RATE_WINDOW * G_USEC_PER_SEC;
+}
+
+static void
+up_device_battery_finalize (GObject *object)
+{
+	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (UP_DEVICE_BATTERY (object));
+
+	g_array_unref (priv->window);
+
+	G_OBJECT_CLASS (up_device_battery_parent_class)->finalize (object);
 }
 
 static void
 up_device_battery_class_init (UpDeviceBatteryClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	UpDeviceClass *device_class = UP_DEVICE_CLASS (klass);
 
+	object_class->finalize = up_device_battery_finalize;
 	device_class->get_on_battery = up_device_battery_get_on_battery;
 }
@@ -84,6 +84,9 @@ typedef struct {
 	UpDeviceTechnology technology;
 	gdouble voltage_design;
 	gint charge_cycles;
+
+	/* in percent, 0 if charging is not limited */
+	gint charge_end_threshold;
 } UpBatteryInfo;
 
 
@@ -34,6 +34,21 @@
 #include "up-history-item.h"
 #include "up-stats-item.h"
 
+/* number of GetHistory replies kept per device */
+#define UP_DEVICE_HISTORY_CACHE_SIZE	8
+
+typedef struct
+{
+	UpHistoryType		 type;
+	guint			 timespan;
+	guint			 resolution;
+	UpHistoryResolutionMode	 mode;
+	guint			 generation;
+	gint64			 expiry;
+	guint64			 last_used;
+	GVariant		*value;
+} UpDeviceHistoryCache;
+
 typedef struct
 {
 	UpDaemon		*daemon;
@@ -43,6 +58,12 @@ typedef struct
 	UpHistory		*history;
 	gboolean		 has_ever_refresh;
 
+	/* finished replies, only valid for the current history object */
+	UpDeviceHistoryCache	 history_cache[UP_DEVICE_HISTORY_CACHE_SIZE];
+	guint64			 history_cache_uses;
+	GVariant		*statistics_cache[2];
+	guint			 statistics_generation[2];
+
 	gint64			last_refresh;
 	int			poll_timeout;
 
@@ -168,6 +189,18 @@ update_icon_name (UpDevice *device)
 	up_exported_device_set_icon_name (skeleton, icon_name);
 }
 
+static void
+up_device_clear_reply_cache (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	guint i;
+
+	for (i = 0; i < UP_DEVICE_HISTORY_CACHE_SIZE; i++)
+		g_clear_pointer (&priv->history_cache[i].value, g_variant_unref);
+	for (i = 0; i < G_N_ELEMENTS (priv->statistics_cache); i++)
+		g_clear_pointer (&priv->statistics_cache[i], g_variant_unref);
+}
+
 static void
 ensure_history (UpDevice *device)
 {
@@ -177,6 +210,9 @@ ensure_history (UpDevice *device)
 	if (priv->history)
 		return;
 
+	/* the cached replies belong to the previous history */
+	up_device_clear_reply_cache (device);
+
 	priv->history = up_history_new ();
 	id = up_device_get_id (device);
 	if (id)
@@ -269,6 +305,23 @@ up_device_get_online (UpDevice *device, gboolean *online)
 	return klass->get_online (device, online);
 }
 
+/**
+ * up_device_ensure_history:
+ *
+ * Return value: (transfer none): the history of the device, loading it
+ *               if needed
+ **/
+UpHistory *
+up_device_ensure_history (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+
+	ensure_history (device);
+	return priv->history;
+}
+
 static gchar *
 up_device_get_id (UpDevice *device)
 {
@@ -541,6 +594,8 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 	GPtrArray *array = NULL;
 	UpStatsItem *item;
 	guint i;
+	guint generation = 0;
+	gint charging = -1;
 	GVariantBuilder builder;
 
 	if (!up_exported_device_get_has_statistics (skeleton)) {
@@ -554,9 +609,21 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 
 	/* get the correct data */
 	if (g_strcmp0 (type, "charging") == 0)
-		array = up_history_get_profile_data (priv->history, TRUE);
+		charging = TRUE;
 	else if (g_strcmp0 (type, "discharging") == 0)
-		array = up_history_get_profile_data (priv->history, FALSE);
+		charging = FALSE;
+
+	/* the statistics only change with the charge data */
+	if (charging >= 0) {
+		generation = up_history_get_generation (priv->history, UP_HISTORY_TYPE_CHARGE);
+		if (priv->statistics_cache[charging] != NULL &&
+		    priv->statistics_generation[charging] == generation) {
+			up_exported_device_complete_get_statistics (skeleton, invocation,
+								    priv->statistics_cache[charging]);
+			goto out;
+		}
+		array = up_history_get_profile_data (priv->history, charging);
+	}
 
 	/* maybe the device doesn't support histories */
 	if (array == NULL) {
@@ -583,14 +650,220 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 				       up_stats_item_get_accuracy (item));
 	}
 
+	g_clear_pointer (&priv->statistics_cache[charging], g_variant_unref);
+	priv->statistics_cache[charging] = g_variant_ref_sink (g_variant_builder_end (&builder));
+	priv->statistics_generation[charging] = generation;
 	up_exported_device_complete_get_statistics (skeleton, invocation,
-						    g_variant_builder_end (&builder));
+						    priv->statistics_cache[charging]);
 out:
 	if (array != NULL)
 		g_ptr_array_unref (array);
 	return TRUE;
 }
 
+static gboolean
+up_device_get_statistics_binned (UpExportedDevice *skeleton,
+				 GDBusMethodInvocation *invocation,
+				 const gchar *type,
+				 guint bin_width,
+				 guint timespan,
+				 UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GArray *bins = NULL;
+	guint i;
+	gint charging = -1;
+	GVariantBuilder builder;
+
+	if (!up_exported_device_get_has_statistics (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting stats");
+		goto out;
+	}
+
+	if (bin_width == 0) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "bin width must not be zero");
+		goto out;
+	}
+
+	ensure_history (device);
+
+	/* get the correct data */
+	if (g_strcmp0 (type, "charging") == 0)
+		charging = TRUE;
+	else if (g_strcmp0 (type, "discharging") == 0)
+		charging = FALSE;
+	if (charging >= 0)
+		bins = up_history_get_statistics (priv->history, charging, bin_width, timespan);
+
+	/* maybe the device doesn't support histories */
+	if (bins == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no statistics");
+		goto out;
+	}
+
+	/* copy data to dbus struct */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uddu)"));
+	for (i = 0; i < bins->len; i++) {
+		const UpHistoryStatisticsBin *bin = &g_array_index (bins, UpHistoryStatisticsBin, i);
+
+		g_variant_builder_add (&builder, "(uddu)",
+				       bin->percentage, bin->mean, bin->variance, bin->count);
+	}
+	up_exported_device_complete_get_statistics_binned (skeleton, invocation,
+							   g_variant_builder_end (&builder));
+
+out:
+	if (bins != NULL)
+		g_array_unref (bins);
+	return TRUE;
+}
+
+/**
+ * up_device_history_cache_lookup:
+ *
+ * Return value: the cache entry for the request, with a %NULL value if
+ *               the reply has to be built (again)
+ **/
+static UpDeviceHistoryCache *
+up_device_history_cache_lookup (UpDevice *device,
+				UpHistoryType type,
+				guint timespan,
+				guint resolution,
+				UpHistoryResolutionMode mode)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceHistoryCache *cache;
+	UpDeviceHistoryCache *oldest = &priv->history_cache[0];
+	guint i;
+
+	for (i = 0; i < UP_DEVICE_HISTORY_CACHE_SIZE; i++) {
+		cache = &priv->history_cache[i];
+		if (cache->value == NULL ||
+		    cache->type != type ||
+		    cache->timespan != timespan ||
+		    cache->resolution != resolution ||
+		    cache->mode != mode) {
+			if (cache->last_used < oldest->last_used)
+				oldest = cache;
+			continue;
+		}
+
+		/* new data, or the window slid past the oldest point */
+		if (cache->generation != up_history_get_generation (priv->history, type) ||
+		    g_get_real_time () / G_USEC_PER_SEC >= cache->expiry)
+			g_clear_pointer (&cache->value, g_variant_unref);
+		cache->last_used = ++priv->history_cache_uses;
+		return cache;
+	}
+
+	/* replace the least recently used entry */
+	g_clear_pointer (&oldest->value, g_variant_unref);
+	oldest->last_used = ++priv->history_cache_uses;
+	return oldest;
+}
+
+/**
+ * up_device_history_type_from_string:
+ **/
+static UpHistoryType
+up_device_history_type_from_string (const gchar *type_string)
+{
+	if (g_strcmp0 (type_string, "rate") == 0)
+		return UP_HISTORY_TYPE_RATE;
+	if (g_strcmp0 (type_string, "charge") == 0)
+		return UP_HISTORY_TYPE_CHARGE;
+	if (g_strcmp0 (type_string, "time-full") == 0)
+		return UP_HISTORY_TYPE_TIME_FULL;
+	if (g_strcmp0 (type_string, "time-empty") == 0)
+		return UP_HISTORY_TYPE_TIME_EMPTY;
+	return UP_HISTORY_TYPE_UNKNOWN;
+}
+
+/**
+ * up_device_get_history_variant:
+ *
+ * Return value: the (cached) reply, owned by the device, or %NULL if an
+ *               error has already been returned on @invocation
+ **/
+static GVariant *
+up_device_get_history_variant (UpDevice *device,
+			       GDBusMethodInvocation *invocation,
+			       const gchar *type_string,
+			       guint timespan,
+			       guint resolution,
+			       UpHistoryResolutionMode mode)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (device);
+	GPtrArray *array = NULL;
+	UpHistoryItem *item;
+	UpDeviceHistoryCache *cache = NULL;
+	GVariant *value = NULL;
+	guint i;
+	UpHistoryType type;
+	GVariantBuilder builder;
+
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		goto out;
+	}
+
+	/* get the correct data */
+	type = up_device_history_type_from_string (type_string);
+
+	/* something recognised */
+	if (type != UP_HISTORY_TYPE_UNKNOWN) {
+		ensure_history (device);
+		cache = up_device_history_cache_lookup (device, type, timespan, resolution, mode);
+		if (cache->value != NULL) {
+			value = cache->value;
+			goto out;
+		}
+		array = up_history_get_data_full (priv->history, type, timespan, resolution, mode);
+	}
+
+	/* maybe the device doesn't have any history */
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		goto out;
+	}
+
+	/* copy data to dbus struct */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
+	for (i = 0; i < array->len; i++) {
+		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		g_variant_builder_add (&builder, "(udu)",
+				       up_history_item_get_time (item),
+				       up_history_item_get_value (item),
+				       up_history_item_get_state (item));
+	}
+
+	cache->type = type;
+	cache->timespan = timespan;
+	cache->resolution = resolution;
+	cache->mode = mode;
+	cache->generation = up_history_get_generation (priv->history, type);
+	cache->expiry = up_history_get_data_expiry (priv->history, type, timespan);
+	cache->value = g_variant_ref_sink (g_variant_builder_end (&builder));
+	value = cache->value;
+
+out:
+	if (array != NULL)
+		g_ptr_array_unref (array);
+	return value;
+}
+
 static gboolean
 up_device_get_history (UpExportedDevice *skeleton,
 		       GDBusMethodInvocation *invocation,
@@ -598,13 +871,61 @@ up_device_get_history (UpExportedDevice *skeleton,
 		       guint timespan,
 		       guint resolution,
 		       UpDevice *device)
+{
+	GVariant *value;
+
+	value = up_device_get_history_variant (device, invocation, type_string, timespan,
+					       resolution, UP_HISTORY_RESOLUTION_MODE_AVERAGE);
+	if (value != NULL)
+		up_exported_device_complete_get_history (skeleton, invocation, value);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_downsampled (UpExportedDevice *skeleton,
+				   GDBusMethodInvocation *invocation,
+				   const gchar *type_string,
+				   guint timespan,
+				   guint resolution,
+				   const gchar *mode_string,
+				   UpDevice *device)
+{
+	UpHistoryResolutionMode mode;
+	GVariant *value;
+
+	mode = up_history_resolution_mode_from_string (mode_string);
+	if (mode == UP_HISTORY_RESOLUTION_MODE_UNKNOWN) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "unknown downsampling mode '%s'", mode_string);
+		return TRUE;
+	}
+
+	value = up_device_get_history_variant (device, invocation, type_string, timespan,
+					       resolution, mode);
+	if (value != NULL)
+		up_exported_device_complete_get_history_downsampled (skeleton, invocation, value);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_range (UpExportedDevice *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *type_string,
+			     guint start,
+			     guint end,
+			     guint max_points,
+			     const gchar *state_filter,
+			     UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
 	GPtrArray *array = NULL;
 	UpHistoryItem *item;
-	guint i;
-	UpHistoryType type = UP_HISTORY_TYPE_UNKNOWN;
+	UpHistoryType type;
+	UpDeviceState state = UP_DEVICE_STATE_UNKNOWN;
 	GVariantBuilder builder;
+	guint32 next = 0;
+	guint i;
 
 	/* doesn't even try to support this */
 	if (!up_exported_device_get_has_history (skeleton)) {
@@ -614,20 +935,22 @@ up_device_get_history (UpExportedDevice *skeleton,
 		goto out;
 	}
 
-	/* get the correct data */
-	if (g_strcmp0 (type_string, "rate") == 0)
-		type = UP_HISTORY_TYPE_RATE;
-	else if (g_strcmp0 (type_string, "charge") == 0)
-		type = UP_HISTORY_TYPE_CHARGE;
-	else if (g_strcmp0 (type_string, "time-full") == 0)
-		type = UP_HISTORY_TYPE_TIME_FULL;
-	else if (g_strcmp0 (type_string, "time-empty") == 0)
-		type = UP_HISTORY_TYPE_TIME_EMPTY;
+	/* an empty filter returns all states */
+	if (state_filter != NULL && state_filter[0] != '\0') {
+		state = up_device_state_from_string (state_filter);
+		if (state == UP_DEVICE_STATE_UNKNOWN) {
+			g_dbus_method_invocation_return_error (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "unknown state '%s'", state_filter);
+			goto out;
+		}
+	}
 
-	/* something recognised */
+	type = up_device_history_type_from_string (type_string);
 	if (type != UP_HISTORY_TYPE_UNKNOWN) {
 		ensure_history (device);
-		array = up_history_get_data (priv->history, type, timespan, resolution);
+		array = up_history_get_range (priv->history, type, start, end,
+					      max_points, state, &next);
 	}
 
 	/* maybe the device doesn't have any history */
@@ -647,9 +970,134 @@ up_device_get_history (UpExportedDevice *skeleton,
 				       up_history_item_get_value (item),
 				       up_history_item_get_state (item));
 	}
+	up_exported_device_complete_get_history_range (skeleton, invocation,
+						       g_variant_builder_end (&builder),
+						       next);
+
+out:
+	if (array != NULL)
+		g_ptr_array_unref (array);
+	return TRUE;
+}
 
-	up_exported_device_complete_get_history (skeleton, invocation,
-						 g_variant_builder_end (&builder));
+static gboolean
+up_device_get_history_multi (UpExportedDevice *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *const *type_strings,
+			     guint timespan,
+			     guint resolution,
+			     UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GPtrArray *result = NULL;
+	UpHistoryType *types;
+	GVariantBuilder builder;
+	guint n_types;
+	guint i, j;
+
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		return TRUE;
+	}
+
+	n_types = g_strv_length ((gchar **) type_strings);
+	types = g_new (UpHistoryType, n_types);
+	for (i = 0; i < n_types; i++) {
+		types[i] = up_device_history_type_from_string (type_strings[i]);
+		if (types[i] == UP_HISTORY_TYPE_UNKNOWN) {
+			g_dbus_method_invocation_return_error (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "unknown history type '%s'", type_strings[i]);
+			goto out;
+		}
+	}
+
+	ensure_history (device);
+	result = up_history_get_data_multi (priv->history, types, n_types, timespan, resolution);
+
+	/* maybe the device doesn't have any history */
+	if (result == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		goto out;
+	}
+
+	/* copy data to dbus struct */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa(udu)}"));
+	for (i = 0; i < result->len; i++) {
+		GPtrArray *array = g_ptr_array_index (result, i);
+
+		g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sa(udu)}"));
+		g_variant_builder_add (&builder, "s", type_strings[i]);
+		g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(udu)"));
+		for (j = 0; j < array->len; j++) {
+			UpHistoryItem *item = (UpHistoryItem *) g_ptr_array_index (array, j);
+
+			g_variant_builder_add (&builder, "(udu)",
+					       up_history_item_get_time (item),
+					       up_history_item_get_value (item),
+					       up_history_item_get_state (item));
+		}
+		g_variant_builder_close (&builder);
+		g_variant_builder_close (&builder);
+	}
+	up_exported_device_complete_get_history_multi (skeleton, invocation,
+						       g_variant_builder_end (&builder));
+
+out:
+	if (result != NULL)
+		g_ptr_array_unref (result);
+	g_free (types);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_state_transitions (UpExportedDevice *skeleton,
+				 GDBusMethodInvocation *invocation,
+				 guint start,
+				 guint end,
+				 UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GPtrArray *array = NULL;
+	UpHistoryItem *item;
+	GVariantBuilder builder;
+	guint i;
+
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		goto out;
+	}
+
+	ensure_history (device);
+	array = up_history_get_transitions (priv->history, start, end);
+
+	/* maybe the device doesn't have any history */
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		goto out;
+	}
+
+	/* copy data to dbus struct */
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
+	for (i = 0; i < array->len; i++) {
+		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		g_variant_builder_add (&builder, "(udu)",
+				       up_history_item_get_time (item),
+				       up_history_item_get_value (item),
+				       up_history_item_get_state (item));
+	}
+	up_exported_device_complete_get_state_transitions (skeleton, invocation,
+							   g_variant_builder_end (&builder));
 
 out:
 	if (array != NULL)
@@ -725,8 +1173,18 @@ up_device_init (UpDevice *device)
 
 	g_signal_connect (device, "handle-get-history",
 			  G_CALLBACK (up_device_get_history), device);
+	g_signal_connect (device, "handle-get-history-downsampled",
+			  G_CALLBACK (up_device_get_history_downsampled), device);
+	g_signal_connect (device, "handle-get-history-range",
+			  G_CALLBACK (up_device_get_history_range), device);
+	g_signal_connect (device, "handle-get-history-multi",
+			  G_CALLBACK (up_device_get_history_multi), device);
+	g_signal_connect (device, "handle-get-state-transitions",
+			  G_CALLBACK (up_device_get_state_transitions), device);
 	g_signal_connect (device, "handle-get-statistics",
 			  G_CALLBACK (up_device_get_statistics), device);
+	g_signal_connect (device, "handle-get-statistics-binned",
+			  G_CALLBACK (up_device_get_statistics_binned), device);
 }
 
 static void
@@ -737,6 +1195,7 @@ up_device_finalize (GObject *object)
 	g_clear_object (&priv->native);
 	g_clear_object (&priv->daemon);
 	g_clear_object (&priv->history);
+	up_device_clear_reply_cache (UP_DEVICE (object));
 
 	G_OBJECT_CLASS (up_device_parent_class)->finalize (object);
 }
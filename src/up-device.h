@@ -24,6 +24,7 @@
 
 #include <dbus/up-device-generated.h>
 #include "up-daemon.h"
+#include "up-history.h"
 
 G_BEGIN_DECLS
 
@@ -67,6 +68,7 @@ gboolean	 up_device_get_on_battery	(UpDevice	*device,
 						 gboolean	*on_battery);
 gboolean	 up_device_get_online		(UpDevice	*device,
 						 gboolean	*online);
+UpHistory	*up_device_ensure_history	(UpDevice	*device);
 void		 up_device_sibling_discovered	(UpDevice	*device,
 						 GObject	*sibling);
 gboolean	 up_device_refresh_internal	(UpDevice	*device,
@@ -0,0 +1,384 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "up-history-codec.h"
+
+/*
+ * Compressed encoding of a run of samples, in the style of the Gorilla
+ * time series database. A block starts with (u32 count, u32 length) and
+ * is followed by a bit stream of @length bytes:
+ *
+ *  - the first sample as 32 bits of time, 64 bits of value, 8 bits of state
+ *  - for every further sample:
+ *    - the delta of the time delta: '0' for none, '10' and 7 bits,
+ *      '110' and 9 bits, '1110' and 12 bits, or '1111' and 64 bits
+ *    - the value XORed with the previous one: '0' if equal, '10' and the
+ *      meaningful bits if they fit in the previous window, or '11' with
+ *      5 bits of leading zeros, 6 bits of length and the meaningful bits
+ *    - '0' if the state did not change, or '1' and 8 bits of state
+ *
+ * Samples come at a regular interval and change slowly, so most of them
+ * take a few bits. Blocks are simply concatenated.
+ */
+#define UP_HISTORY_CODEC_BLOCK_HEADER_SIZE	8
+
+typedef struct {
+	GByteArray	*buf;
+	guint64		 acc;
+	guint		 bits;
+} UpHistoryBitWriter;
+
+typedef struct {
+	const guint8	*data;
+	gsize		 length;
+	gsize		 pos;
+	guint64		 acc;
+	guint		 bits;
+} UpHistoryBitReader;
+
+static void
+up_history_bit_writer_put (UpHistoryBitWriter *writer, guint64 value, guint bits)
+{
+	/* split so the accumulator never holds more than 64 bits */
+	if (bits > 32) {
+		up_history_bit_writer_put (writer, value >> 32, bits - 32);
+		value &= G_MAXUINT32;
+		bits = 32;
+	}
+	if (bits < 64)
+		value &= (G_GUINT64_CONSTANT (1) << bits) - 1;
+	writer->acc = (writer->acc << bits) | value;
+	writer->bits += bits;
+	while (writer->bits >= 8) {
+		guint8 byte = writer->acc >> (writer->bits - 8);
+
+		g_byte_array_append (writer->buf, &byte, 1);
+		writer->bits -= 8;
+	}
+}
+
+static void
+up_history_bit_writer_flush (UpHistoryBitWriter *writer)
+{
+	if (writer->bits > 0)
+		up_history_bit_writer_put (writer, 0, 8 - writer->bits);
+}
+
+static inline gboolean
+up_history_bit_reader_get (UpHistoryBitReader *reader, guint bits, guint64 *value)
+{
+	guint64 result = 0;
+
+	while (bits > 0) {
+		guint take;
+
+		if (reader->bits == 0) {
+			if (reader->pos >= reader->length)
+				return FALSE;
+			reader->acc = reader->data[reader->pos++];
+			reader->bits = 8;
+		}
+		take = MIN (bits, reader->bits);
+		result = (result << take) |
+			 ((reader->acc >> (reader->bits - take)) & ((1u << take) - 1));
+		reader->bits -= take;
+		bits -= take;
+	}
+	*value = result;
+	return TRUE;
+}
+
+static inline gint64
+up_history_codec_sign_extend (guint64 value, guint bits)
+{
+	guint64 sign = G_GUINT64_CONSTANT (1) << (bits - 1);
+
+	return (gint64) ((value ^ sign) - sign);
+}
+
+static guint64
+up_history_codec_double_bits (gdouble value)
+{
+	guint64 bits;
+
+	memcpy (&bits, &value, sizeof (bits));
+	return bits;
+}
+
+/**
+ * up_history_codec_encode:
+ * @buf: the buffer to append the block to
+ * @from: the index of the first entry to encode
+ *
+ * Appends a compressed block holding the entries of @series from @from.
+ **/
+void
+up_history_codec_encode (GByteArray *buf, const UpHistorySeries *series, guint from)
+{
+	UpHistoryBitWriter writer = { buf, 0, 0 };
+	guint8 header[UP_HISTORY_CODEC_BLOCK_HEADER_SIZE];
+	gsize offset;
+	guint32 tmp;
+	gint64 delta = 0;
+	guint64 value;
+	guint leading = G_MAXUINT;
+	guint trailing = 0;
+	guint i;
+
+	if (from >= series->len)
+		return;
+
+	offset = buf->len;
+	tmp = GUINT32_TO_LE (series->len - from);
+	memcpy (header, &tmp, 4);
+	g_byte_array_append (buf, header, sizeof (header));
+
+	up_history_bit_writer_put (&writer, up_history_series_get_time (series, from), 32);
+	value = up_history_codec_double_bits (up_history_series_get_value (series, from));
+	up_history_bit_writer_put (&writer, value, 64);
+	up_history_bit_writer_put (&writer, up_history_series_get_state (series, from), 8);
+
+	for (i = from + 1; i < series->len; i++) {
+		gint64 new_delta;
+		gint64 dod;
+		guint64 new_value;
+		guint64 xor;
+
+		/* time */
+		new_delta = (gint64) up_history_series_get_time (series, i) -
+			    (gint64) up_history_series_get_time (series, i - 1);
+		dod = new_delta - delta;
+		delta = new_delta;
+		if (dod == 0) {
+			up_history_bit_writer_put (&writer, 0x0, 1);
+		} else if (dod >= -64 && dod <= 63) {
+			up_history_bit_writer_put (&writer, 0x2, 2);
+			up_history_bit_writer_put (&writer, dod, 7);
+		} else if (dod >= -256 && dod <= 255) {
+			up_history_bit_writer_put (&writer, 0x6, 3);
+			up_history_bit_writer_put (&writer, dod, 9);
+		} else if (dod >= -2048 && dod <= 2047) {
+			up_history_bit_writer_put (&writer, 0xe, 4);
+			up_history_bit_writer_put (&writer, dod, 12);
+		} else {
+			up_history_bit_writer_put (&writer, 0xf, 4);
+			up_history_bit_writer_put (&writer, dod, 64);
+		}
+
+		/* value */
+		new_value = up_history_codec_double_bits (up_history_series_get_value (series, i));
+		xor = new_value ^ value;
+		value = new_value;
+		if (xor == 0) {
+			up_history_bit_writer_put (&writer, 0x0, 1);
+		} else {
+			guint new_leading = MIN (__builtin_clzll (xor), 31);
+			guint new_trailing = __builtin_ctzll (xor);
+
+			if (leading != G_MAXUINT &&
+			    new_leading >= leading && new_trailing >= trailing) {
+				up_history_bit_writer_put (&writer, 0x2, 2);
+				up_history_bit_writer_put (&writer, xor >> trailing, 64 - leading - trailing);
+			} else {
+				guint length = 64 - new_leading - new_trailing;
+
+				leading = new_leading;
+				trailing = new_trailing;
+				up_history_bit_writer_put (&writer, 0x3, 2);
+				up_history_bit_writer_put (&writer, leading, 5);
+				/* a length of 64 is stored as 0 */
+				up_history_bit_writer_put (&writer, length, 6);
+				up_history_bit_writer_put (&writer, xor >> trailing, length);
+			}
+		}
+
+		/* state */
+		if (up_history_series_get_state (series, i) == up_history_series_get_state (series, i - 1)) {
+			up_history_bit_writer_put (&writer, 0x0, 1);
+		} else {
+			up_history_bit_writer_put (&writer, 0x1, 1);
+			up_history_bit_writer_put (&writer, up_history_series_get_state (series, i), 8);
+		}
+	}
+	up_history_bit_writer_flush (&writer);
+
+	tmp = GUINT32_TO_LE (buf->len - offset - UP_HISTORY_CODEC_BLOCK_HEADER_SIZE);
+	memcpy (buf->data + offset + 4, &tmp, 4);
+}
+
+/**
+ * up_history_codec_decode_block:
+ **/
+static gboolean
+up_history_codec_decode_block (UpHistorySeries *series,
+			       guint32 count,
+			       const guint8 *data,
+			       gsize length,
+			       gint64 since,
+			       guint *skipped)
+{
+	UpHistoryBitReader reader = { data, length, 0, 0, 0 };
+	guint64 tmp;
+	guint64 value;
+	gdouble value_d;
+	guint32 time_s;
+	gint64 delta = 0;
+	guint8 state;
+	guint leading = 0;
+	guint trailing = 0;
+	guint32 i;
+
+	if (count == 0)
+		return TRUE;
+
+	if (!up_history_bit_reader_get (&reader, 32, &tmp))
+		return FALSE;
+	time_s = tmp;
+	if (!up_history_bit_reader_get (&reader, 64, &value))
+		return FALSE;
+	if (!up_history_bit_reader_get (&reader, 8, &tmp))
+		return FALSE;
+	state = tmp;
+	memcpy (&value_d, &value, sizeof (value_d));
+	if (time_s >= since)
+		up_history_series_append (series, time_s, value_d, state);
+	else
+		(*skipped)++;
+
+	for (i = 1; i < count; i++) {
+		guint prefix = 0;
+
+		/* time */
+		while (prefix < 4) {
+			if (!up_history_bit_reader_get (&reader, 1, &tmp))
+				return FALSE;
+			if (tmp == 0)
+				break;
+			prefix++;
+		}
+		switch (prefix) {
+		case 0:
+			break;
+		case 1:
+			if (!up_history_bit_reader_get (&reader, 7, &tmp))
+				return FALSE;
+			delta += up_history_codec_sign_extend (tmp, 7);
+			break;
+		case 2:
+			if (!up_history_bit_reader_get (&reader, 9, &tmp))
+				return FALSE;
+			delta += up_history_codec_sign_extend (tmp, 9);
+			break;
+		case 3:
+			if (!up_history_bit_reader_get (&reader, 12, &tmp))
+				return FALSE;
+			delta += up_history_codec_sign_extend (tmp, 12);
+			break;
+		default:
+			if (!up_history_bit_reader_get (&reader, 64, &tmp))
+				return FALSE;
+			delta += (gint64) tmp;
+			break;
+		}
+		time_s += delta;
+
+		/* value */
+		if (!up_history_bit_reader_get (&reader, 1, &tmp))
+			return FALSE;
+		if (tmp != 0) {
+			if (!up_history_bit_reader_get (&reader, 1, &tmp))
+				return FALSE;
+			if (tmp != 0) {
+				guint64 bits;
+
+				if (!up_history_bit_reader_get (&reader, 5, &tmp) ||
+				    !up_history_bit_reader_get (&reader, 6, &bits))
+					return FALSE;
+				if (bits == 0)
+					bits = 64;
+				if (tmp + bits > 64)
+					return FALSE;
+				leading = tmp;
+				trailing = 64 - leading - bits;
+			}
+			if (!up_history_bit_reader_get (&reader, 64 - leading - trailing, &tmp))
+				return FALSE;
+			value ^= tmp << trailing;
+			memcpy (&value_d, &value, sizeof (value_d));
+		}
+
+		/* state */
+		if (!up_history_bit_reader_get (&reader, 1, &tmp))
+			return FALSE;
+		if (tmp != 0) {
+			if (!up_history_bit_reader_get (&reader, 8, &tmp))
+				return FALSE;
+			state = tmp;
+		}
+		if (time_s >= since)
+			up_history_series_append (series, time_s, value_d, state);
+		else
+			(*skipped)++;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_codec_decode:
+ * @since: the time of the oldest sample to keep
+ * @skipped: (out) (optional): the number of samples older than @since
+ *
+ * Appends the samples of all the blocks in @data to @series.
+ *
+ * Return value: %FALSE if the data is corrupt
+ **/
+gboolean
+up_history_codec_decode (UpHistorySeries *series,
+			 const guint8 *data,
+			 gsize length,
+			 gint64 since,
+			 guint *skipped)
+{
+	guint skipped_tmp = 0;
+	gsize pos = 0;
+
+	if (skipped == NULL)
+		skipped = &skipped_tmp;
+
+	while (pos + UP_HISTORY_CODEC_BLOCK_HEADER_SIZE <= length) {
+		guint32 count;
+		guint32 size;
+
+		memcpy (&count, data + pos, 4);
+		memcpy (&size, data + pos + 4, 4);
+		count = GUINT32_FROM_LE (count);
+		size = GUINT32_FROM_LE (size);
+		pos += UP_HISTORY_CODEC_BLOCK_HEADER_SIZE;
+		if (pos + size > length)
+			return FALSE;
+		if (!up_history_codec_decode_block (series, count, data + pos, size, since, skipped))
+			return FALSE;
+		pos += size;
+	}
+	return pos == length;
+}
@@ -0,0 +1,279 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "up-history-file.h"
+
+/*
+ * A history file holds all the data of one device. It starts with a
+ * header of (magic, u32 version, u32 section count, u32 log offset),
+ * followed by a table of (u8 section, u8 sub, u16 reserved, u32 offset,
+ * u32 length) entries, and the data of those sections. The table is only
+ * written when the whole file is rewritten. Data saved in between is
+ * appended after the log offset as chunks of (u8 section, u8 sub,
+ * u16 reserved, u32 length) followed by the data, so that a save is a
+ * single write. All integers are little endian.
+ */
+#define UP_HISTORY_FILE_MAGIC		"UPHC"
+#define UP_HISTORY_FILE_VERSION		1
+#define UP_HISTORY_FILE_HEADER_SIZE	16
+#define UP_HISTORY_FILE_ENTRY_SIZE	12
+#define UP_HISTORY_FILE_CHUNK_SIZE	8
+
+static guint32
+up_history_file_get_u32 (const guint8 *data)
+{
+	guint32 tmp;
+
+	memcpy (&tmp, data, 4);
+	return GUINT32_FROM_LE (tmp);
+}
+
+static void
+up_history_file_set_u32 (guint8 *data, guint32 value)
+{
+	value = GUINT32_TO_LE (value);
+	memcpy (data, &value, 4);
+}
+
+/**
+ * up_history_file_begin_chunk:
+ * @chunks: the chunks to be saved
+ *
+ * Starts a new chunk, the data of which is appended to @chunks by the
+ * caller before calling up_history_file_end_chunk().
+ *
+ * Return value: the offset of the chunk
+ **/
+gsize
+up_history_file_begin_chunk (GByteArray *chunks, UpHistorySection section, guint8 sub)
+{
+	guint8 header[UP_HISTORY_FILE_CHUNK_SIZE] = { 0 };
+	gsize offset = chunks->len;
+
+	header[0] = section;
+	header[1] = sub;
+	g_byte_array_append (chunks, header, sizeof (header));
+	return offset;
+}
+
+/**
+ * up_history_file_end_chunk:
+ * @offset: the value returned by up_history_file_begin_chunk()
+ *
+ * Finishes a chunk, empty chunks are dropped.
+ **/
+void
+up_history_file_end_chunk (GByteArray *chunks, gsize offset)
+{
+	gsize length = chunks->len - offset - UP_HISTORY_FILE_CHUNK_SIZE;
+
+	if (length == 0) {
+		g_byte_array_set_size (chunks, offset);
+		return;
+	}
+	up_history_file_set_u32 (chunks->data + offset + 4, length);
+}
+
+/**
+ * up_history_file_pack:
+ * @chunks: the complete data of the file
+ *
+ * Return value: the contents of a new file holding @chunks as sections
+ **/
+GByteArray *
+up_history_file_pack (const GByteArray *chunks)
+{
+	GByteArray *buf;
+	guint8 header[UP_HISTORY_FILE_HEADER_SIZE] = { 0 };
+	guint8 entry[UP_HISTORY_FILE_ENTRY_SIZE] = { 0 };
+	guint count = 0;
+	gsize data_offset;
+	gsize i;
+
+	for (i = 0; i < chunks->len; i += UP_HISTORY_FILE_CHUNK_SIZE + up_history_file_get_u32 (chunks->data + i + 4))
+		count++;
+	data_offset = UP_HISTORY_FILE_HEADER_SIZE + count * UP_HISTORY_FILE_ENTRY_SIZE;
+
+	buf = g_byte_array_sized_new (data_offset + chunks->len);
+	memcpy (header, UP_HISTORY_FILE_MAGIC, 4);
+	up_history_file_set_u32 (header + 4, UP_HISTORY_FILE_VERSION);
+	up_history_file_set_u32 (header + 8, count);
+	g_byte_array_append (buf, header, sizeof (header));
+
+	/* the table */
+	for (i = 0; i < chunks->len; ) {
+		guint32 length = up_history_file_get_u32 (chunks->data + i + 4);
+
+		entry[0] = chunks->data[i];
+		entry[1] = chunks->data[i + 1];
+		up_history_file_set_u32 (entry + 4, data_offset);
+		up_history_file_set_u32 (entry + 8, length);
+		g_byte_array_append (buf, entry, sizeof (entry));
+		data_offset += length;
+		i += UP_HISTORY_FILE_CHUNK_SIZE + length;
+	}
+
+	/* the data of the sections */
+	for (i = 0; i < chunks->len; ) {
+		guint32 length = up_history_file_get_u32 (chunks->data + i + 4);
+
+		g_byte_array_append (buf, chunks->data + i + UP_HISTORY_FILE_CHUNK_SIZE, length);
+		i += UP_HISTORY_FILE_CHUNK_SIZE + length;
+	}
+
+	/* anything appended later goes after the sections */
+	up_history_file_set_u32 (buf->data + 12, buf->len);
+	return buf;
+}
+
+/**
+ * up_history_file_parse:
+ * @valid_length: (out): the length of the data up to the last complete chunk
+ *
+ * Calls @func for every section and appended chunk, in the order they were
+ * written. A trailing partial chunk is the result of an interrupted write
+ * and is ignored.
+ **/
+gboolean
+up_history_file_parse (const guint8 *data,
+		       gsize length,
+		       UpHistoryFileFunc func,
+		       gpointer user_data,
+		       gsize *valid_length,
+		       GError **error)
+{
+	guint32 count;
+	gsize log_offset;
+	gsize pos;
+	guint i;
+
+	if (length < UP_HISTORY_FILE_HEADER_SIZE ||
+	    memcmp (data, UP_HISTORY_FILE_MAGIC, 4) != 0) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "not a history file");
+		return FALSE;
+	}
+	if (up_history_file_get_u32 (data + 4) != UP_HISTORY_FILE_VERSION) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			     "unsupported version %u", up_history_file_get_u32 (data + 4));
+		return FALSE;
+	}
+	count = up_history_file_get_u32 (data + 8);
+	log_offset = up_history_file_get_u32 (data + 12);
+	if (log_offset > length ||
+	    UP_HISTORY_FILE_HEADER_SIZE + (guint64) count * UP_HISTORY_FILE_ENTRY_SIZE > log_offset) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "invalid section table");
+		return FALSE;
+	}
+
+	/* sections written on the last rewrite */
+	for (i = 0; i < count; i++) {
+		const guint8 *entry = data + UP_HISTORY_FILE_HEADER_SIZE + i * UP_HISTORY_FILE_ENTRY_SIZE;
+		guint32 offset = up_history_file_get_u32 (entry + 4);
+		guint32 size = up_history_file_get_u32 (entry + 8);
+
+		if ((guint64) offset + size > log_offset) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "section %u is out of bounds", i);
+			return FALSE;
+		}
+		func (entry[0], entry[1], data + offset, size, user_data);
+	}
+
+	/* data appended since */
+	pos = log_offset;
+	while (pos + UP_HISTORY_FILE_CHUNK_SIZE <= length) {
+		guint32 size = up_history_file_get_u32 (data + pos + 4);
+
+		if (pos + UP_HISTORY_FILE_CHUNK_SIZE + size > length)
+			break;
+		func (data[pos], data[pos + 1], data + pos + UP_HISTORY_FILE_CHUNK_SIZE, size, user_data);
+		pos += UP_HISTORY_FILE_CHUNK_SIZE + size;
+	}
+	if (valid_length != NULL)
+		*valid_length = pos;
+	return TRUE;
+}
+
+/**
+ * up_history_file_append:
+ * @valid_length: the length of the file as known to be valid
+ * @chunks: the chunks to append
+ *
+ * Appends chunks to an existing file with a single write and makes sure
+ * they hit the disk. Anything after @valid_length is dropped first.
+ **/
+gboolean
+up_history_file_append (const gchar *filename,
+			gsize valid_length,
+			const GByteArray *chunks,
+			GError **error)
+{
+	struct stat st;
+	gsize written = 0;
+	gint fd;
+	gboolean ret = FALSE;
+
+	fd = g_open (filename, O_WRONLY | O_APPEND | O_CLOEXEC, 0);
+	if (fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to open %s: %s", filename, g_strerror (errno));
+		return FALSE;
+	}
+
+	/* drop a partial chunk left behind by an interrupted write */
+	if (fstat (fd, &st) == 0 && (gsize) st.st_size != valid_length &&
+	    ftruncate (fd, valid_length) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to truncate %s: %s", filename, g_strerror (errno));
+		goto out;
+	}
+
+	while (written < chunks->len) {
+		gssize len = write (fd, chunks->data + written, chunks->len - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "failed to write %s: %s", filename, g_strerror (errno));
+			goto out;
+		}
+		written += len;
+	}
+	if (fdatasync (fd) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to sync %s: %s", filename, g_strerror (errno));
+		goto out;
+	}
+	ret = TRUE;
+out:
+	close (fd);
+	return ret;
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The kinds of data stored in a history file */
+typedef enum {
+	UP_HISTORY_SECTION_SERIES	= 1,	/* samples, per UpHistoryType */
+	UP_HISTORY_SECTION_ROLLUP	= 2,	/* complete buckets, per UpHistoryType */
+	UP_HISTORY_SECTION_PROFILE	= 3,	/* the charge profile, latest wins */
+	UP_HISTORY_SECTION_PACKED	= 4,	/* compressed samples, per UpHistoryType */
+	UP_HISTORY_SECTION_TRANSITIONS	= 5,	/* compressed charge samples at state changes */
+	UP_HISTORY_SECTION_VOLTAGE	= 6,	/* the learned voltage table, latest wins */
+} UpHistorySection;
+
+typedef void	(*UpHistoryFileFunc)			(UpHistorySection	 section,
+							 guint8			 sub,
+							 const guint8		*data,
+							 gsize			 length,
+							 gpointer		 user_data);
+
+gsize		 up_history_file_begin_chunk		(GByteArray		*chunks,
+							 UpHistorySection	 section,
+							 guint8			 sub);
+void		 up_history_file_end_chunk		(GByteArray		*chunks,
+							 gsize			 offset);
+GByteArray	*up_history_file_pack			(const GByteArray	*chunks);
+gboolean	 up_history_file_parse			(const guint8		*data,
+							 gsize			 length,
+							 UpHistoryFileFunc	 func,
+							 gpointer		 user_data,
+							 gsize			*valid_length,
+							 GError			**error);
+gboolean	 up_history_file_append			(const gchar		*filename,
+							 gsize			 valid_length,
+							 const GByteArray	*chunks,
+							 GError			**error);
+
+G_END_DECLS
@@ -0,0 +1,241 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "up-history-journal.h"
+
+/*
+ * The journal holds the samples that are not in the history file yet. It
+ * lives on a tmpfs, so appending to it does not wake up the disk, and it
+ * survives a crash of the daemon but not a reboot. It is a plain list of
+ * little endian records of (u8 type, u32 time, f64 value, u8 state).
+ *
+ * When the history is saved, the journal is moved to a second file, which
+ * is removed once the save has completed, so that samples added while a
+ * save is in flight are never lost.
+ */
+#define UP_HISTORY_JOURNAL_RECORD_SIZE	14
+
+/**
+ * up_history_journal_trim:
+ *
+ * Drops a partial record left behind by an interrupted write.
+ **/
+static gboolean
+up_history_journal_trim (gint fd, const gchar *filename, GError **error)
+{
+	struct stat st;
+
+	if (fstat (fd, &st) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to stat %s: %s", filename, g_strerror (errno));
+		return FALSE;
+	}
+	if (st.st_size % UP_HISTORY_JOURNAL_RECORD_SIZE == 0)
+		return TRUE;
+	if (ftruncate (fd, st.st_size - st.st_size % UP_HISTORY_JOURNAL_RECORD_SIZE) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to truncate %s: %s", filename, g_strerror (errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_journal_write:
+ **/
+static gboolean
+up_history_journal_write (gint fd, const guint8 *data, gsize length, GError **error)
+{
+	gsize written = 0;
+
+	while (written < length) {
+		gssize len = write (fd, data + written, length - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "failed to write journal: %s", g_strerror (errno));
+			return FALSE;
+		}
+		written += len;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_journal_open:
+ * @filename: the journal, which is created if needed
+ *
+ * Return value: a file descriptor to append to, or -1 on error
+ **/
+gint
+up_history_journal_open (const gchar *filename, GError **error)
+{
+	gchar *dir;
+	gint fd;
+
+	dir = g_path_get_dirname (filename);
+	if (g_mkdir_with_parents (dir, 0755) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to create %s: %s", dir, g_strerror (errno));
+		g_free (dir);
+		return -1;
+	}
+	g_free (dir);
+
+	fd = g_open (filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to open %s: %s", filename, g_strerror (errno));
+		return -1;
+	}
+	if (!up_history_journal_trim (fd, filename, error)) {
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * up_history_journal_append:
+ *
+ * Adds a sample to the journal. Nothing is synced, the journal is meant
+ * to be on a tmpfs.
+ **/
+gboolean
+up_history_journal_append (gint fd,
+			   guint8 type,
+			   guint32 time,
+			   gdouble value,
+			   UpDeviceState state,
+			   GError **error)
+{
+	guint8 record[UP_HISTORY_JOURNAL_RECORD_SIZE];
+	guint32 tmp32;
+	guint64 tmp64;
+
+	record[0] = type;
+	tmp32 = GUINT32_TO_LE (time);
+	memcpy (record + 1, &tmp32, 4);
+	memcpy (&tmp64, &value, 8);
+	tmp64 = GUINT64_TO_LE (tmp64);
+	memcpy (record + 5, &tmp64, 8);
+	record[13] = (guint8) state;
+	return up_history_journal_write (fd, record, sizeof (record), error);
+}
+
+/**
+ * up_history_journal_rotate:
+ * @fd: the journal
+ * @old_filename: the journal of the saves in flight
+ *
+ * Moves the contents of the journal to the end of @old_filename, and
+ * empties the journal.
+ **/
+gboolean
+up_history_journal_rotate (gint fd, const gchar *old_filename, GError **error)
+{
+	gboolean ret = FALSE;
+	guint8 *data = NULL;
+	struct stat st;
+	gint old_fd;
+
+	if (fstat (fd, &st) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to stat journal: %s", g_strerror (errno));
+		return FALSE;
+	}
+	if (st.st_size == 0)
+		return TRUE;
+
+	old_fd = g_open (old_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (old_fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to open %s: %s", old_filename, g_strerror (errno));
+		return FALSE;
+	}
+	if (!up_history_journal_trim (old_fd, old_filename, error))
+		goto out;
+
+	data = g_malloc (st.st_size);
+	if (pread (fd, data, st.st_size, 0) != st.st_size) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to read journal: %s", g_strerror (errno));
+		goto out;
+	}
+	if (!up_history_journal_write (old_fd, data, st.st_size, error))
+		goto out;
+	if (ftruncate (fd, 0) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to truncate journal: %s", g_strerror (errno));
+		goto out;
+	}
+	ret = TRUE;
+out:
+	g_free (data);
+	close (old_fd);
+	return ret;
+}
+
+/**
+ * up_history_journal_replay:
+ * @func: called for each sample, in the order they were added
+ *
+ * A journal that does not exist is empty.
+ **/
+gboolean
+up_history_journal_replay (const gchar *filename,
+			   UpHistoryJournalFunc func,
+			   gpointer user_data,
+			   GError **error)
+{
+	gchar *contents = NULL;
+	gsize length = 0;
+	gsize i;
+
+	if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+		return TRUE;
+	if (!g_file_get_contents (filename, &contents, &length, error))
+		return FALSE;
+
+	for (i = 0; i + UP_HISTORY_JOURNAL_RECORD_SIZE <= length; i += UP_HISTORY_JOURNAL_RECORD_SIZE) {
+		const guint8 *record = (const guint8 *) contents + i;
+		guint32 time;
+		guint64 tmp64;
+		gdouble value;
+
+		memcpy (&time, record + 1, 4);
+		memcpy (&tmp64, record + 5, 8);
+		tmp64 = GUINT64_FROM_LE (tmp64);
+		memcpy (&value, &tmp64, 8);
+		func (record[0], GUINT32_FROM_LE (time), value, record[13], user_data);
+	}
+	g_free (contents);
+	return TRUE;
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "up-types.h"
+
+G_BEGIN_DECLS
+
+typedef void	(*UpHistoryJournalFunc)			(guint8			 type,
+							 guint32		 time,
+							 gdouble		 value,
+							 UpDeviceState		 state,
+							 gpointer		 user_data);
+
+gint		 up_history_journal_open		(const gchar		*filename,
+							 GError			**error);
+gboolean	 up_history_journal_append		(gint			 fd,
+							 guint8			 type,
+							 guint32		 time,
+							 gdouble		 value,
+							 UpDeviceState		 state,
+							 GError			**error);
+gboolean	 up_history_journal_rotate		(gint			 fd,
+							 const gchar		*old_filename,
+							 GError			**error);
+gboolean	 up_history_journal_replay		(const gchar		*filename,
+							 UpHistoryJournalFunc	 func,
+							 gpointer		 user_data,
+							 GError			**error);
+
+G_END_DECLS
@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <math.h>
+
+#include "up-history-profile.h"
+
+/* the bin of the previous point, before any point was seen */
+#define UP_HISTORY_PROFILE_NO_BIN	999
+
+/**
+ * up_history_profile_init:
+ **/
+void
+up_history_profile_init (UpHistoryProfile *profile)
+{
+	memset (profile, 0, sizeof (*profile));
+	profile->last_state = UP_DEVICE_STATE_LAST;
+	profile->oldbin = UP_HISTORY_PROFILE_NO_BIN;
+}
+
+/**
+ * up_history_profile_get_time:
+ * @from: the lower percentage
+ * @to: the upper percentage
+ *
+ * Adds up the typical time per percentage point between @from and @to.
+ * Points that were never seen are assumed to take the average time of
+ * the ones that were.
+ *
+ * Return value: the time in seconds, or a negative value if less than
+ *               half of the percentage points were seen
+ **/
+gdouble
+up_history_profile_get_time (const UpHistoryProfile *profile, UpHistoryProfileKind kind, gdouble from, gdouble to)
+{
+	gdouble total = 0.0;
+	guint known = 0;
+	guint first;
+	guint last;
+	guint bin;
+
+	first = (guint) CLAMP (floor (from) + 1, 0, UP_HISTORY_PROFILE_BINS);
+	last = (guint) CLAMP (floor (to), 0, UP_HISTORY_PROFILE_BINS - 1);
+	if (first > last)
+		return 0.0;
+
+	for (bin = first; bin <= last; bin++) {
+		if (profile->count[kind][bin] == 0)
+			continue;
+		total += profile->sum[kind][bin] / profile->count[kind][bin];
+		known++;
+	}
+	if (known * 2 < last - first + 1)
+		return -1.0;
+	return total * (last - first + 1) / known;
+}
+
+/**
+ * up_history_profile_slabs_new:
+ *
+ * Return value: an empty array of #UpHistoryProfileSlab, oldest first
+ **/
+GArray *
+up_history_profile_slabs_new (void)
+{
+	return g_array_new (FALSE, FALSE, sizeof (UpHistoryProfileSlab));
+}
+
+/**
+ * up_history_profile_slabs_remove_before:
+ *
+ * Drops the slabs that end before @time.
+ **/
+void
+up_history_profile_slabs_remove_before (GArray *slabs, gint64 time)
+{
+	guint count = 0;
+
+	while (count < slabs->len &&
+	       (gint64) g_array_index (slabs, UpHistoryProfileSlab, count).start +
+	       UP_HISTORY_PROFILE_SLAB_WIDTH <= time)
+		count++;
+	if (count > 0)
+		g_array_remove_range (slabs, 0, count);
+}
+
+/**
+ * up_history_profile_slabs_add:
+ **/
+static void
+up_history_profile_slabs_add (GArray *slabs, guint32 time, UpHistoryProfileKind kind, guint bin, gdouble duration)
+{
+	UpHistoryProfileSlab *slab = NULL;
+	guint32 start = time - time % UP_HISTORY_PROFILE_SLAB_WIDTH;
+
+	/* the samples come in order, so only the last slab can match */
+	if (slabs->len > 0)
+		slab = &g_array_index (slabs, UpHistoryProfileSlab, slabs->len - 1);
+	if (slab == NULL || slab->start != start) {
+		g_array_set_size (slabs, slabs->len + 1);
+		slab = &g_array_index (slabs, UpHistoryProfileSlab, slabs->len - 1);
+		memset (slab, 0, sizeof (*slab));
+		slab->start = start;
+	}
+	slab->sum[kind][bin] += duration;
+	slab->sumsq[kind][bin] += duration * duration;
+	slab->count[kind][bin]++;
+}
+
+/**
+ * up_history_profile_add:
+ * @slabs: (nullable): the per day sums to update as well
+ *
+ * Adds the next sample of the charge series. The time between two points
+ * in the same state is added to the bin of the newer point, unless the
+ * percentage barely moved or jumped.
+ **/
+void
+up_history_profile_add (UpHistoryProfile *profile, GArray *slabs, guint32 time, gdouble value, UpDeviceState state)
+{
+	UpHistoryProfileKind kind;
+	gdouble diff;
+	guint bin;
+
+	profile->covered = time;
+	profile->dirty = TRUE;
+
+	if (state != profile->last_state) {
+		profile->has_old = FALSE;
+		goto out;
+	}
+
+	/* round to the nearest int, and ensure bin is in range */
+	bin = rint (value);
+	if (bin >= UP_HISTORY_PROFILE_BINS)
+		bin = UP_HISTORY_PROFILE_BINS - 1;
+
+	/* different */
+	if (profile->oldbin == bin)
+		goto out;
+	profile->oldbin = bin;
+	if (profile->has_old) {
+		/* not enough or too much difference */
+		diff = fabs (value - profile->old_value);
+		if (diff < 0.01f || diff > 3.0f) {
+			profile->has_old = FALSE;
+			goto out;
+		}
+
+		if (state == UP_DEVICE_STATE_CHARGING)
+			kind = UP_HISTORY_PROFILE_CHARGING;
+		else if (state == UP_DEVICE_STATE_DISCHARGING)
+			kind = UP_HISTORY_PROFILE_DISCHARGING;
+		else
+			kind = UP_HISTORY_PROFILE_LAST;
+		if (kind != UP_HISTORY_PROFILE_LAST) {
+			profile->sum[kind][bin] += time - profile->old_time;
+			profile->count[kind][bin]++;
+			if (slabs != NULL)
+				up_history_profile_slabs_add (slabs, time, kind, bin, time - profile->old_time);
+		}
+	}
+	profile->has_old = TRUE;
+	profile->old_time = time;
+	profile->old_value = value;
+out:
+	profile->last_state = state;
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "up-types.h"
+
+G_BEGIN_DECLS
+
+#define UP_HISTORY_PROFILE_BINS		101
+
+typedef enum {
+	UP_HISTORY_PROFILE_CHARGING,
+	UP_HISTORY_PROFILE_DISCHARGING,
+	UP_HISTORY_PROFILE_LAST
+} UpHistoryProfileKind;
+
+/* The time spent per percentage point of the charge series, summed up as
+ * the samples come in so that statistics do not need to walk the history */
+typedef struct {
+	gdouble		 sum[UP_HISTORY_PROFILE_LAST][UP_HISTORY_PROFILE_BINS];
+	guint32		 count[UP_HISTORY_PROFILE_LAST][UP_HISTORY_PROFILE_BINS];
+	/* time of the last sample that was added */
+	guint32		 covered;
+	/* state of the scan over the samples */
+	UpDeviceState	 last_state;
+	guint		 oldbin;
+	gboolean	 has_old;
+	guint32		 old_time;
+	gdouble		 old_value;
+	gboolean	 dirty;
+} UpHistoryProfile;
+
+/* The same sums per day, with the sum of squares, so that statistics over
+ * a time window can be had without walking the history, with a variance */
+#define UP_HISTORY_PROFILE_SLAB_WIDTH	(24 * 60 * 60)
+
+typedef struct {
+	guint32		 start;
+	gdouble		 sum[UP_HISTORY_PROFILE_LAST][UP_HISTORY_PROFILE_BINS];
+	gdouble		 sumsq[UP_HISTORY_PROFILE_LAST][UP_HISTORY_PROFILE_BINS];
+	guint32		 count[UP_HISTORY_PROFILE_LAST][UP_HISTORY_PROFILE_BINS];
+} UpHistoryProfileSlab;
+
+void		 up_history_profile_init		(UpHistoryProfile	*profile);
+void		 up_history_profile_add			(UpHistoryProfile	*profile,
+							 GArray			*slabs,
+							 guint32		 time,
+							 gdouble		 value,
+							 UpDeviceState		 state);
+gdouble		 up_history_profile_get_time		(const UpHistoryProfile	*profile,
+							 UpHistoryProfileKind	 kind,
+							 gdouble		 from,
+							 gdouble		 to);
+GArray		*up_history_profile_slabs_new		(void);
+void		 up_history_profile_slabs_remove_before	(GArray			*slabs,
+							 gint64			 time);
+
+G_END_DECLS
@@ -0,0 +1,200 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "up-history-rollup.h"
+
+#define UP_HISTORY_ROLLUP_MIN_ALLOC	16
+
+/**
+ * up_history_rollup_init:
+ * @width: the width of a bucket in seconds
+ **/
+void
+up_history_rollup_init (UpHistoryRollup *rollup, guint32 width)
+{
+	memset (rollup, 0, sizeof (*rollup));
+	rollup->width = width;
+}
+
+/**
+ * up_history_rollup_clear:
+ **/
+void
+up_history_rollup_clear (UpHistoryRollup *rollup)
+{
+	guint32 width = rollup->width;
+
+	g_free (rollup->first);
+	g_free (rollup->last);
+	g_free (rollup->count);
+	g_free (rollup->sum);
+	g_free (rollup->min);
+	g_free (rollup->max);
+	g_free (rollup->state);
+	up_history_rollup_init (rollup, width);
+}
+
+/**
+ * up_history_rollup_make_room:
+ **/
+static void
+up_history_rollup_make_room (UpHistoryRollup *rollup)
+{
+	if (rollup->start + rollup->len < rollup->alloc)
+		return;
+
+	/* more than half of the space is taken by dropped buckets */
+	if (rollup->start > rollup->alloc / 2) {
+		memmove (rollup->first, rollup->first + rollup->start, rollup->len * sizeof (*rollup->first));
+		memmove (rollup->last, rollup->last + rollup->start, rollup->len * sizeof (*rollup->last));
+		memmove (rollup->count, rollup->count + rollup->start, rollup->len * sizeof (*rollup->count));
+		memmove (rollup->sum, rollup->sum + rollup->start, rollup->len * sizeof (*rollup->sum));
+		memmove (rollup->min, rollup->min + rollup->start, rollup->len * sizeof (*rollup->min));
+		memmove (rollup->max, rollup->max + rollup->start, rollup->len * sizeof (*rollup->max));
+		memmove (rollup->state, rollup->state + rollup->start, rollup->len * sizeof (*rollup->state));
+		rollup->start = 0;
+		return;
+	}
+
+	rollup->alloc = MAX (rollup->alloc * 2, UP_HISTORY_ROLLUP_MIN_ALLOC);
+	rollup->first = g_renew (guint32, rollup->first, rollup->alloc);
+	rollup->last = g_renew (guint32, rollup->last, rollup->alloc);
+	rollup->count = g_renew (guint32, rollup->count, rollup->alloc);
+	rollup->sum = g_renew (gdouble, rollup->sum, rollup->alloc);
+	rollup->min = g_renew (gdouble, rollup->min, rollup->alloc);
+	rollup->max = g_renew (gdouble, rollup->max, rollup->alloc);
+	rollup->state = g_renew (guint8, rollup->state, rollup->alloc);
+}
+
+/**
+ * up_history_rollup_append_bucket:
+ *
+ * Adds a complete bucket, as read back from disk.
+ **/
+void
+up_history_rollup_append_bucket (UpHistoryRollup *rollup,
+				 guint32 first,
+				 guint32 last,
+				 guint32 count,
+				 gdouble sum,
+				 gdouble min,
+				 gdouble max,
+				 UpDeviceState state)
+{
+	guint pos;
+
+	up_history_rollup_make_room (rollup);
+	pos = rollup->start + rollup->len;
+	rollup->first[pos] = first;
+	rollup->last[pos] = last;
+	rollup->count[pos] = count;
+	rollup->sum[pos] = sum;
+	rollup->min[pos] = min;
+	rollup->max[pos] = max;
+	rollup->state[pos] = (guint8) state;
+	rollup->len++;
+}
+
+/**
+ * up_history_rollup_add:
+ *
+ * Folds a new sample into the last bucket, or starts a new bucket if the
+ * sample belongs to a different time slot or state.
+ **/
+void
+up_history_rollup_add (UpHistoryRollup *rollup, guint32 time, gdouble value, UpDeviceState state)
+{
+	guint pos;
+
+	if (rollup->len > 0) {
+		pos = rollup->start + rollup->len - 1;
+		if (rollup->state[pos] == (guint8) state &&
+		    rollup->first[pos] / rollup->width == time / rollup->width) {
+			rollup->last[pos] = time;
+			rollup->count[pos]++;
+			rollup->sum[pos] += value;
+			rollup->min[pos] = MIN (rollup->min[pos], value);
+			rollup->max[pos] = MAX (rollup->max[pos], value);
+			return;
+		}
+	}
+	up_history_rollup_append_bucket (rollup, time, time, 1, value, value, value, state);
+}
+
+/**
+ * up_history_rollup_remove_before:
+ *
+ * Drops all buckets that only contain samples older than @time.
+ **/
+void
+up_history_rollup_remove_before (UpHistoryRollup *rollup, gint64 time)
+{
+	guint count = 0;
+
+	while (count < rollup->len && rollup->last[rollup->start + count] < time)
+		count++;
+	rollup->start += count;
+	rollup->len -= count;
+	rollup->saved -= MIN (count, rollup->saved);
+	if (rollup->len == 0)
+		rollup->start = 0;
+}
+
+/**
+ * up_history_rollup_get_size:
+ *
+ * Return value: the memory used by the buckets, in bytes
+ **/
+gsize
+up_history_rollup_get_size (const UpHistoryRollup *rollup)
+{
+	return (gsize) rollup->alloc * (sizeof (*rollup->first) +
+					sizeof (*rollup->last) +
+					sizeof (*rollup->count) +
+					sizeof (*rollup->sum) +
+					sizeof (*rollup->min) +
+					sizeof (*rollup->max) +
+					sizeof (*rollup->state));
+}
+
+/**
+ * up_history_rollup_find_time:
+ *
+ * Return value: the index of the first bucket starting at or after @time
+ **/
+guint
+up_history_rollup_find_time (const UpHistoryRollup *rollup, gint64 time)
+{
+	guint low = 0;
+	guint high = rollup->len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		if (rollup->first[rollup->start + mid] < time)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
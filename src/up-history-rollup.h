@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "up-types.h"
+
+G_BEGIN_DECLS
+
+/* A history series summarized into fixed time buckets. A new bucket is
+ * also started whenever the state changes, so buckets never mix states. */
+typedef struct {
+	guint32		 width;
+	guint32		*first;
+	guint32		*last;
+	guint32		*count;
+	gdouble		*sum;
+	gdouble		*min;
+	gdouble		*max;
+	guint8		*state;
+	guint		 start;
+	guint		 len;
+	guint		 alloc;
+	/* number of leading buckets already written to disk */
+	guint		 saved;
+} UpHistoryRollup;
+
+void		 up_history_rollup_init			(UpHistoryRollup	*rollup,
+							 guint32		 width);
+void		 up_history_rollup_clear		(UpHistoryRollup	*rollup);
+void		 up_history_rollup_add			(UpHistoryRollup	*rollup,
+							 guint32		 time,
+							 gdouble		 value,
+							 UpDeviceState		 state);
+void		 up_history_rollup_append_bucket	(UpHistoryRollup	*rollup,
+							 guint32		 first,
+							 guint32		 last,
+							 guint32		 count,
+							 gdouble		 sum,
+							 gdouble		 min,
+							 gdouble		 max,
+							 UpDeviceState		 state);
+void		 up_history_rollup_remove_before	(UpHistoryRollup	*rollup,
+							 gint64			 time);
+gsize		 up_history_rollup_get_size		(const UpHistoryRollup	*rollup);
+guint		 up_history_rollup_find_time		(const UpHistoryRollup	*rollup,
+							 gint64			 time);
+
+#define UP_HISTORY_ROLLUP_IDX(rollup, i)	((rollup)->start + (i))
+
+G_END_DECLS
@@ -0,0 +1,239 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "up-history-series.h"
+
+#define UP_HISTORY_SERIES_MIN_ALLOC	64
+
+/**
+ * up_history_series_init:
+ **/
+void
+up_history_series_init (UpHistorySeries *series)
+{
+	memset (series, 0, sizeof (*series));
+}
+
+/**
+ * up_history_series_clear:
+ **/
+void
+up_history_series_clear (UpHistorySeries *series)
+{
+	g_free (series->time);
+	g_free (series->value);
+	g_free (series->state);
+	up_history_series_init (series);
+}
+
+/**
+ * up_history_series_make_room:
+ *
+ * Ensures there is space for one more entry at the end, either by moving
+ * the entries back to the start of the arrays or by growing them.
+ **/
+static void
+up_history_series_make_room (UpHistorySeries *series)
+{
+	if (series->start + series->len < series->alloc)
+		return;
+
+	/* more than half of the space is taken by dropped entries */
+	if (series->start > series->alloc / 2) {
+		memmove (series->time, series->time + series->start,
+			 series->len * sizeof (*series->time));
+		memmove (series->value, series->value + series->start,
+			 series->len * sizeof (*series->value));
+		memmove (series->state, series->state + series->start,
+			 series->len * sizeof (*series->state));
+		series->start = 0;
+		return;
+	}
+
+	series->alloc = MAX (series->alloc * 2, UP_HISTORY_SERIES_MIN_ALLOC);
+	series->time = g_renew (guint32, series->time, series->alloc);
+	series->value = g_renew (gdouble, series->value, series->alloc);
+	series->state = g_renew (guint8, series->state, series->alloc);
+}
+
+/**
+ * up_history_series_append:
+ **/
+void
+up_history_series_append (UpHistorySeries *series, guint32 time, gdouble value, UpDeviceState state)
+{
+	guint pos;
+
+	up_history_series_make_room (series);
+	pos = series->start + series->len;
+	series->time[pos] = time;
+	series->value[pos] = value;
+	series->state[pos] = (guint8) state;
+	series->len++;
+}
+
+/**
+ * up_history_series_copy:
+ * @dest: an uninitialized series
+ * @from: the index of the first entry to copy
+ *
+ * Copies the entries of @src from @from onwards into @dest.
+ **/
+void
+up_history_series_copy (UpHistorySeries *dest, const UpHistorySeries *src, guint from)
+{
+	guint count;
+
+	up_history_series_init (dest);
+	if (from >= src->len)
+		return;
+	count = src->len - from;
+	dest->alloc = count;
+	dest->len = count;
+	dest->time = g_new (guint32, count);
+	dest->value = g_new (gdouble, count);
+	dest->state = g_new (guint8, count);
+	memcpy (dest->time, src->time + src->start + from, count * sizeof (*src->time));
+	memcpy (dest->value, src->value + src->start + from, count * sizeof (*src->value));
+	memcpy (dest->state, src->state + src->start + from, count * sizeof (*src->state));
+}
+
+/**
+ * up_history_series_remove_head:
+ * @count: the number of entries to drop from the start
+ **/
+void
+up_history_series_remove_head (UpHistorySeries *series, guint count)
+{
+	count = MIN (count, series->len);
+	series->start += count;
+	series->len -= count;
+	series->saved -= MIN (count, series->saved);
+	if (series->len == 0)
+		series->start = 0;
+}
+
+/**
+ * up_history_series_downsample:
+ * @count: the number of entries at the start to downsample
+ *
+ * Merges neighbouring entries with the same state among the first @count
+ * entries, keeping the time of the first and the mean of the values, so
+ * that old data is kept at a lower resolution. A saved entry is never
+ * merged with one that is not saved yet, so that the entries after the
+ * saved ones are still the ones to save.
+ *
+ * Return value: the number of entries removed
+ **/
+guint
+up_history_series_downsample (UpHistorySeries *series, guint count)
+{
+	guint saved = series->saved;
+	guint removed;
+	guint r, w;
+
+	count = MIN (count, series->len);
+	for (r = 0, w = 0; r < count; w++) {
+		guint pos_r = series->start + r;
+		guint pos_w = series->start + w;
+
+		if (r == series->saved)
+			saved = w;
+		series->time[pos_w] = series->time[pos_r];
+		series->state[pos_w] = series->state[pos_r];
+		if (r + 1 < count && r + 1 != series->saved &&
+		    series->state[pos_r] == series->state[pos_r + 1]) {
+			series->value[pos_w] = (series->value[pos_r] + series->value[pos_r + 1]) / 2;
+			r += 2;
+		} else {
+			series->value[pos_w] = series->value[pos_r];
+			r++;
+		}
+	}
+	removed = count - w;
+	if (removed == 0)
+		return 0;
+
+	/* move the newer entries up */
+	memmove (series->time + series->start + w, series->time + series->start + count,
+		 (series->len - count) * sizeof (*series->time));
+	memmove (series->value + series->start + w, series->value + series->start + count,
+		 (series->len - count) * sizeof (*series->value));
+	memmove (series->state + series->start + w, series->state + series->start + count,
+		 (series->len - count) * sizeof (*series->state));
+	series->len -= removed;
+	series->saved = series->saved >= count ? series->saved - removed : saved;
+	return removed;
+}
+
+/**
+ * up_history_series_get_size:
+ *
+ * Return value: the memory used by the entries, in bytes
+ **/
+gsize
+up_history_series_get_size (const UpHistorySeries *series)
+{
+	return (gsize) series->alloc * (sizeof (*series->time) +
+					sizeof (*series->value) +
+					sizeof (*series->state));
+}
+
+/**
+ * up_history_series_find_time:
+ * @time: the time to search for
+ *
+ * Return value: the index of the first entry at or after @time, or the
+ *               length of the series if there is none
+ **/
+guint
+up_history_series_find_time (const UpHistorySeries *series, gint64 time)
+{
+	guint low = 0;
+	guint high = series->len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		if (up_history_series_get_time (series, mid) < time)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/**
+ * up_history_series_slice:
+ * @since: the time of the oldest entry to include
+ * @view: the view to set up
+ *
+ * Sets @view to the entries that are not older than @since.
+ **/
+void
+up_history_series_slice (const UpHistorySeries *series, gint64 since, UpHistorySeriesView *view)
+{
+	view->series = series;
+	view->offset = up_history_series_find_time (series, since);
+	view->len = series->len - view->offset;
+}
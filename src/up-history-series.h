@@ -0,0 +1,105 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "up-types.h"
+
+G_BEGIN_DECLS
+
+/* A time ordered series of history samples, stored as parallel arrays.
+ * The valid entries are always contiguous, starting at @start, so that
+ * dropping old entries is cheap and the data can be walked directly. */
+typedef struct {
+	guint32		*time;
+	gdouble		*value;
+	guint8		*state;
+	guint		 start;
+	guint		 len;
+	guint		 alloc;
+	/* number of leading entries already written to disk */
+	guint		 saved;
+} UpHistorySeries;
+
+/* A contiguous range of a series, without copying the data */
+typedef struct {
+	const UpHistorySeries	*series;
+	guint			 offset;
+	guint			 len;
+} UpHistorySeriesView;
+
+void		 up_history_series_init			(UpHistorySeries	*series);
+void		 up_history_series_clear		(UpHistorySeries	*series);
+void		 up_history_series_append		(UpHistorySeries	*series,
+							 guint32		 time,
+							 gdouble		 value,
+							 UpDeviceState		 state);
+void		 up_history_series_copy		(UpHistorySeries	*dest,
+							 const UpHistorySeries	*src,
+							 guint			 from);
+void		 up_history_series_remove_head		(UpHistorySeries	*series,
+							 guint			 count);
+guint		 up_history_series_downsample		(UpHistorySeries	*series,
+							 guint			 count);
+gsize		 up_history_series_get_size		(const UpHistorySeries	*series);
+guint		 up_history_series_find_time		(const UpHistorySeries	*series,
+							 gint64			 time);
+void		 up_history_series_slice		(const UpHistorySeries	*series,
+							 gint64			 since,
+							 UpHistorySeriesView	*view);
+
+static inline guint32
+up_history_series_get_time (const UpHistorySeries *series, guint i)
+{
+	return series->time[series->start + i];
+}
+
+static inline gdouble
+up_history_series_get_value (const UpHistorySeries *series, guint i)
+{
+	return series->value[series->start + i];
+}
+
+static inline UpDeviceState
+up_history_series_get_state (const UpHistorySeries *series, guint i)
+{
+	return (UpDeviceState) series->state[series->start + i];
+}
+
+static inline guint32
+up_history_series_view_get_time (const UpHistorySeriesView *view, guint i)
+{
+	return up_history_series_get_time (view->series, view->offset + i);
+}
+
+static inline gdouble
+up_history_series_view_get_value (const UpHistorySeriesView *view, guint i)
+{
+	return up_history_series_get_value (view->series, view->offset + i);
+}
+
+static inline UpDeviceState
+up_history_series_view_get_state (const UpHistorySeriesView *view, guint i)
+{
+	return up_history_series_get_state (view->series, view->offset + i);
+}
+
+G_END_DECLS
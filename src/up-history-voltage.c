@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <math.h>
+
+#include "up-history-voltage.h"
+
+/* older readings are forgotten slowly, so that the table follows aging */
+#define UP_HISTORY_VOLTAGE_MAX_WEIGHT	64
+
+/* how far a mean may move before the table is worth saving again */
+#define UP_HISTORY_VOLTAGE_SAVE_TOLERANCE	0.01	/* V */
+
+/**
+ * up_history_voltage_init:
+ **/
+void
+up_history_voltage_init (UpHistoryVoltage *voltage)
+{
+	memset (voltage, 0, sizeof (*voltage));
+}
+
+/**
+ * up_history_voltage_get_soc_bin:
+ **/
+static guint
+up_history_voltage_get_soc_bin (gdouble percentage)
+{
+	return (guint) CLAMP (rint (percentage / UP_HISTORY_VOLTAGE_SOC_WIDTH),
+			      0, UP_HISTORY_VOLTAGE_SOC_BINS - 1);
+}
+
+/**
+ * up_history_voltage_get_temp_bin:
+ * @temperature: in °C, or exactly 0 if unknown
+ **/
+static guint
+up_history_voltage_get_temp_bin (gdouble temperature)
+{
+	/* most batteries without a sensor are at room temperature */
+	if (temperature == 0.0)
+		temperature = 25.0;
+	return (guint) CLAMP (floor (temperature / UP_HISTORY_VOLTAGE_TEMP_WIDTH),
+			      0, UP_HISTORY_VOLTAGE_TEMP_BINS - 1);
+}
+
+/**
+ * up_history_voltage_add:
+ * @percentage: the state of charge
+ * @temperature: the battery temperature in °C, or 0 if unknown
+ * @value: the voltage in V
+ *
+ * Folds a voltage reading into the running mean of its bin.
+ **/
+void
+up_history_voltage_add (UpHistoryVoltage *voltage, gdouble percentage, gdouble temperature, gdouble value)
+{
+	guint soc = up_history_voltage_get_soc_bin (percentage);
+	guint temp = up_history_voltage_get_temp_bin (temperature);
+
+	if (voltage->count[temp][soc] < UP_HISTORY_VOLTAGE_MAX_WEIGHT)
+		voltage->count[temp][soc]++;
+	voltage->mean[temp][soc] += (value - voltage->mean[temp][soc]) / voltage->count[temp][soc];
+	if (fabs (voltage->mean[temp][soc] - voltage->saved[temp][soc]) > UP_HISTORY_VOLTAGE_SAVE_TOLERANCE)
+		voltage->dirty = TRUE;
+}
+
+/**
+ * up_history_voltage_mark_saved:
+ *
+ * Remembers the current means as the ones on disk.
+ **/
+void
+up_history_voltage_mark_saved (UpHistoryVoltage *voltage)
+{
+	memcpy (voltage->saved, voltage->mean, sizeof (voltage->saved));
+	voltage->dirty = FALSE;
+}
+
+/**
+ * up_history_voltage_get_bin:
+ *
+ * Return value: the learned voltage of a bin, from the nearest temperature
+ *               that has any, or @fallback if there is none
+ **/
+static gdouble
+up_history_voltage_get_bin (const UpHistoryVoltage *voltage, guint soc, guint temp, gdouble fallback)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_VOLTAGE_TEMP_BINS; i++) {
+		if (temp >= i && voltage->count[temp - i][soc] > 0)
+			return voltage->mean[temp - i][soc];
+		if (temp + i < UP_HISTORY_VOLTAGE_TEMP_BINS && voltage->count[temp + i][soc] > 0)
+			return voltage->mean[temp + i][soc];
+	}
+	return fallback;
+}
+
+/**
+ * up_history_voltage_get_mean:
+ * @from: the lower state of charge
+ * @to: the upper state of charge
+ * @temperature: the battery temperature in °C, or 0 if unknown
+ * @fallback: the voltage to use where nothing was learned yet
+ *
+ * The energy stored between two states of charge is the charge times the
+ * mean voltage over that range. Use the same value for @from and @to to
+ * get the voltage at one state of charge.
+ *
+ * Return value: the mean voltage in V
+ **/
+gdouble
+up_history_voltage_get_mean (const UpHistoryVoltage *voltage,
+			     gdouble from,
+			     gdouble to,
+			     gdouble temperature,
+			     gdouble fallback)
+{
+	guint first = up_history_voltage_get_soc_bin (from);
+	guint last = up_history_voltage_get_soc_bin (to);
+	guint temp = up_history_voltage_get_temp_bin (temperature);
+	gdouble sum = 0.0;
+	guint soc;
+
+	if (first > last)
+		return fallback;
+	for (soc = first; soc <= last; soc++)
+		sum += up_history_voltage_get_bin (voltage, soc, temp, fallback);
+	return sum / (last - first + 1);
+}
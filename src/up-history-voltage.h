@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define UP_HISTORY_VOLTAGE_SOC_WIDTH	5	/* percentage points */
+#define UP_HISTORY_VOLTAGE_SOC_BINS	(100 / UP_HISTORY_VOLTAGE_SOC_WIDTH + 1)
+#define UP_HISTORY_VOLTAGE_TEMP_WIDTH	10	/* °C */
+#define UP_HISTORY_VOLTAGE_TEMP_BINS	5
+
+/* The battery voltage per state of charge and temperature, learned from
+ * readings at a low current, which are close to the open circuit voltage. */
+typedef struct {
+	gdouble		 mean[UP_HISTORY_VOLTAGE_TEMP_BINS][UP_HISTORY_VOLTAGE_SOC_BINS];
+	guint32		 count[UP_HISTORY_VOLTAGE_TEMP_BINS][UP_HISTORY_VOLTAGE_SOC_BINS];
+	/* the means as last saved, dirty is set once one moved away */
+	gdouble		 saved[UP_HISTORY_VOLTAGE_TEMP_BINS][UP_HISTORY_VOLTAGE_SOC_BINS];
+	gboolean	 dirty;
+} UpHistoryVoltage;
+
+void		 up_history_voltage_init		(UpHistoryVoltage	*voltage);
+void		 up_history_voltage_mark_saved		(UpHistoryVoltage	*voltage);
+void		 up_history_voltage_add			(UpHistoryVoltage	*voltage,
+							 gdouble		 percentage,
+							 gdouble		 temperature,
+							 gdouble		 value);
+gdouble		 up_history_voltage_get_mean		(const UpHistoryVoltage	*voltage,
+							 gdouble		 from,
+							 gdouble		 to,
+							 gdouble		 temperature,
+							 gdouble		 fallback);
+
+G_END_DECLS
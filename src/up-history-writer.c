@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib-object.h>
+
+#include "up-history-writer.h"
+
+/*
+ * All the histories of the daemon are saved together, so that the disk
+ * is woken up once per batch rather than once per device. A history that
+ * has new data joins the current batch, and can only move the batch
+ * earlier, e.g. when a battery is running low.
+ */
+
+static void     up_history_writer_finalize	(GObject     *object);
+
+struct _UpHistoryWriterPrivate
+{
+	/* histories with unsaved data, not referenced */
+	GPtrArray			*dirty;
+	GSource				*source;
+	gint64				 deadline;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (UpHistoryWriter, up_history_writer, G_TYPE_OBJECT)
+
+static gpointer up_history_writer_object = NULL;
+
+/**
+ * up_history_writer_clear_source:
+ **/
+static void
+up_history_writer_clear_source (UpHistoryWriter *writer)
+{
+	if (writer->priv->source == NULL)
+		return;
+	g_source_destroy (writer->priv->source);
+	g_clear_pointer (&writer->priv->source, g_source_unref);
+}
+
+/**
+ * up_history_writer_take_dirty:
+ *
+ * Return value: the histories of the current batch; histories scheduled
+ *               while saving go into the next batch
+ **/
+static GPtrArray *
+up_history_writer_take_dirty (UpHistoryWriter *writer)
+{
+	GPtrArray *dirty;
+
+	up_history_writer_clear_source (writer);
+	dirty = writer->priv->dirty;
+	writer->priv->dirty = g_ptr_array_new ();
+	g_debug ("saving %u histories", dirty->len);
+	return dirty;
+}
+
+/**
+ * up_history_writer_flush:
+ *
+ * Saves all the histories that have unsaved data now, and waits for the
+ * data to be on disk.
+ **/
+void
+up_history_writer_flush (UpHistoryWriter *writer)
+{
+	GPtrArray *dirty;
+	guint i;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	dirty = up_history_writer_take_dirty (writer);
+	for (i = 0; i < dirty->len; i++)
+		up_history_save_data (UP_HISTORY (g_ptr_array_index (dirty, i)));
+	g_ptr_array_unref (dirty);
+}
+
+/**
+ * up_history_writer_timeout_cb:
+ *
+ * The writes of the batch happen on worker threads, so the main context
+ * is not blocked by slow storage.
+ **/
+static gboolean
+up_history_writer_timeout_cb (gpointer user_data)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (user_data);
+	GPtrArray *dirty;
+	guint i;
+
+	dirty = up_history_writer_take_dirty (writer);
+	for (i = 0; i < dirty->len; i++)
+		up_history_save_data_async (UP_HISTORY (g_ptr_array_index (dirty, i)),
+					    NULL, NULL, NULL);
+	g_ptr_array_unref (dirty);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * up_history_writer_schedule:
+ * @timeout: the time in seconds within which the data should be saved
+ *
+ * Adds the history to the next batch, moving the batch earlier if needed.
+ **/
+void
+up_history_writer_schedule (UpHistoryWriter *writer, UpHistory *history, guint timeout)
+{
+	UpHistoryWriterPrivate *priv;
+	gint64 deadline;
+	guint i;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	priv = writer->priv;
+	for (i = 0; i < priv->dirty->len; i++) {
+		if (g_ptr_array_index (priv->dirty, i) == history)
+			break;
+	}
+	if (i == priv->dirty->len)
+		g_ptr_array_add (priv->dirty, history);
+
+	/* the batch is already due early enough */
+	deadline = g_get_monotonic_time () + (gint64) timeout * G_USEC_PER_SEC;
+	if (priv->source != NULL && priv->deadline <= deadline) {
+		g_debug ("deferring as earlier save is already queued");
+		return;
+	}
+
+	g_debug ("saving in %u seconds", timeout);
+	up_history_writer_clear_source (writer);
+	priv->deadline = deadline;
+	priv->source = g_timeout_source_new_seconds (timeout);
+	g_source_set_name (priv->source, "[upower] up_history_writer_timeout_cb");
+	g_source_set_callback (priv->source, up_history_writer_timeout_cb, writer, NULL);
+	g_source_attach (priv->source, NULL);
+}
+
+/**
+ * up_history_writer_cancel:
+ *
+ * Removes the history from the next batch, e.g. because it is going away.
+ **/
+void
+up_history_writer_cancel (UpHistoryWriter *writer, UpHistory *history)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	g_ptr_array_remove (writer->priv->dirty, history);
+	if (writer->priv->dirty->len == 0)
+		up_history_writer_clear_source (writer);
+}
+
+/**
+ * up_history_writer_class_init:
+ **/
+static void
+up_history_writer_class_init (UpHistoryWriterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_history_writer_finalize;
+}
+
+/**
+ * up_history_writer_init:
+ **/
+static void
+up_history_writer_init (UpHistoryWriter *writer)
+{
+	writer->priv = up_history_writer_get_instance_private (writer);
+	writer->priv->dirty = g_ptr_array_new ();
+}
+
+/**
+ * up_history_writer_finalize:
+ **/
+static void
+up_history_writer_finalize (GObject *object)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (object);
+
+	/* every history holds a reference, so there is nothing left to save */
+	up_history_writer_clear_source (writer);
+	g_ptr_array_unref (writer->priv->dirty);
+
+	G_OBJECT_CLASS (up_history_writer_parent_class)->finalize (object);
+}
+
+/**
+ * up_history_writer_new:
+ *
+ * Return value: the writer shared by all histories
+ **/
+UpHistoryWriter *
+up_history_writer_new (void)
+{
+	if (up_history_writer_object != NULL) {
+		g_object_ref (up_history_writer_object);
+	} else {
+		up_history_writer_object = g_object_new (UP_TYPE_HISTORY_WRITER, NULL);
+		g_object_add_weak_pointer (up_history_writer_object, &up_history_writer_object);
+	}
+	return UP_HISTORY_WRITER (up_history_writer_object);
+}
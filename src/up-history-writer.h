@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UP_HISTORY_WRITER_H
+#define __UP_HISTORY_WRITER_H
+
+#include <glib-object.h>
+
+#include "up-history.h"
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_HISTORY_WRITER		(up_history_writer_get_type ())
+#define UP_HISTORY_WRITER(o)		(G_TYPE_CHECK_INSTANCE_CAST ((o), UP_TYPE_HISTORY_WRITER, UpHistoryWriter))
+#define UP_HISTORY_WRITER_CLASS(k)	(G_TYPE_CHECK_CLASS_CAST((k), UP_TYPE_HISTORY_WRITER, UpHistoryWriterClass))
+#define UP_IS_HISTORY_WRITER(o)		(G_TYPE_CHECK_INSTANCE_TYPE ((o), UP_TYPE_HISTORY_WRITER))
+
+typedef struct _UpHistoryWriterPrivate	UpHistoryWriterPrivate;
+typedef struct _UpHistoryWriter		UpHistoryWriter;
+typedef struct _UpHistoryWriterClass	UpHistoryWriterClass;
+
+struct _UpHistoryWriter
+{
+	 GObject			 parent;
+	 UpHistoryWriterPrivate		*priv;
+};
+
+struct _UpHistoryWriterClass
+{
+	GObjectClass			 parent_class;
+};
+
+GType		 up_history_writer_get_type		(void);
+UpHistoryWriter	*up_history_writer_new			(void);
+void		 up_history_writer_schedule		(UpHistoryWriter	*writer,
+							 UpHistory		*history,
+							 guint			 timeout);
+void		 up_history_writer_cancel		(UpHistoryWriter	*writer,
+							 UpHistory		*history);
+void		 up_history_writer_flush		(UpHistoryWriter	*writer);
+
+G_END_DECLS
+
+#endif /* __UP_HISTORY_WRITER_H */
@@ -23,20 +23,68 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "up-history.h"
+#include "up-history-series.h"
+#include "up-history-rollup.h"
+#include "up-history-profile.h"
+#include "up-history-voltage.h"
+#include "up-history-file.h"
+#include "up-history-codec.h"
+#include "up-history-writer.h"
+#include "up-history-journal.h"
+#include "up-config.h"
 #include "up-stats-item.h"
 #include "up-history-item.h"
 
 static void	up_history_finalize	(GObject		*object);
+static gboolean	up_history_schedule_save (UpHistory		*history);
 
 #define UP_HISTORY_SAVE_INTERVAL	(10*60)		/* seconds */
 #define UP_HISTORY_SAVE_INTERVAL_LOW_POWER	5	/* seconds */
+#define UP_HISTORY_JOURNAL_SAVE_INTERVAL	(60*60)	/* seconds */
 #define UP_HISTORY_LOW_POWER_PERCENT	10
 #define UP_HISTORY_DEFAULT_MAX_DATA_AGE	(7*24*60*60)	/* seconds */
+#define UP_HISTORY_COMPACT_INTERVAL	(24*60*60)	/* seconds */
+#define UP_HISTORY_DEFAULT_MAX_SERIES_SAMPLES	10000
+#define UP_HISTORY_DEFAULT_MAX_DEVICE_SAMPLES	30000
+#define UP_HISTORY_DEFAULT_MAX_TOTAL_SAMPLES	200000
+
+/* All data of a device is stored in one file, see up-history-file.c. The
+ * samples of a series are compressed, see up-history-codec.c. Older
+ * versions stored them as packed little-endian records of
+ * (u32 time, f64 value, u8 state). */
+#define UP_HISTORY_RECORD_SIZE		13
+
+/* Complete rollup buckets are stored as records of (u8 tier, u8 state,
+ * u32 first, u32 last, u32 count, f64 sum, f64 min, f64 max). The last
+ * bucket of each tier is recreated from the series when loading. */
+#define UP_HISTORY_ROLLUP_RECORD_SIZE	38
+#define UP_HISTORY_ROLLUP_TIERS		3
+
+/* The charge profile is stored as the scan state, followed by records of
+ * (f64 sum, u32 count) for every charging and then discharging bin. */
+#define UP_HISTORY_PROFILE_RECORD_SIZE	12
+#define UP_HISTORY_PROFILE_STATE_SIZE	28
+
+/* The voltage table is stored as records of (f64 mean, u32 count) for
+ * every state of charge, one temperature after the other. */
+#define UP_HISTORY_VOLTAGE_RECORD_SIZE	12
+
+/* Older versions used a file per series, with a header followed by the
+ * same records as above */
+#define UP_HISTORY_SERIES_MAGIC		"UPHI"
+#define UP_HISTORY_SERIES_VERSION	1
+#define UP_HISTORY_SERIES_HEADER_SIZE	16
 
 struct UpHistoryPrivate
 {
@@ -46,13 +94,51 @@ struct UpHistoryPrivate
 	gint64			 time_empty_last;
 	gdouble			 percentage_last;
 	UpDeviceState		 state;
-	GPtrArray		*data_rate;
-	GPtrArray		*data_charge;
-	GPtrArray		*data_time_full;
-	GPtrArray		*data_time_empty;
-	GSource			*save_source;
+	/* indexed by UpHistoryType */
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryRollup		 rollup[UP_HISTORY_TYPE_UNKNOWN][UP_HISTORY_ROLLUP_TIERS];
+	UpHistoryProfile	 profile;
+	/* the profile per day, rebuilt from the samples when loading */
+	GArray			*profile_slabs;
+	/* the charge samples at which the state changed */
+	UpHistorySeries		 transitions;
+	UpHistoryVoltage	 voltage;
+	/* bumped whenever the data of a series changes */
+	guint			 generation[UP_HISTORY_TYPE_UNKNOWN];
+	gint64			 last_compact;
+	/* the file state is shared with the writing thread, under file_lock */
+	GMutex			 file_lock;
+	GCond			 file_cond;
+	gboolean		 file_writing;
+	/* the length of the file up to the last complete chunk */
+	gsize			 file_length;
+	gboolean		 file_invalid;
+	/* the file has entries that are not in memory, because they were
+	 * too old to be loaded or have been downsampled */
+	gboolean		 file_stale;
+	gint64			 load_since;
+	/* the write in flight and the callers it serves, and the callers
+	 * waiting for the next write */
+	GTask			*save_task;
+	GPtrArray		*save_waiters;
+	GPtrArray		*save_queue;
+	UpHistoryWriter		*writer;
+	/* samples not in the file yet, see up-history-journal.c */
+	gint			 journal_fd;
+	guint			 journal_seq;
 	guint			 max_data_age;
+	/* new samples closer than this to the last one are not recorded */
+	gdouble			 tolerance[UP_HISTORY_TYPE_UNKNOWN];
+	gdouble			 relative_tolerance[UP_HISTORY_TYPE_UNKNOWN];
+	guint			 max_silence;
+	/* limits on the number of samples kept in memory */
+	guint			 max_series_samples;
+	guint			 max_device_samples;
+	guint			 max_total_samples;
+	/* the samples of this history in up_history_total_samples */
+	guint			 samples;
 	gchar			*dir;
+	gchar			*journal_dir;
 };
 
 enum {
@@ -62,6 +148,25 @@ enum {
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpHistory, up_history, G_TYPE_OBJECT)
 
+/* the samples in memory of all the histories of the daemon */
+static guint up_history_total_samples = 0;
+static guint up_history_count = 0;
+
+/* used for the filenames, indexed by UpHistoryType */
+static const gchar *up_history_type_names[] = {
+	"charge",
+	"rate",
+	"time-full",
+	"time-empty",
+};
+
+/* bucket widths in seconds, from the finest to the coarsest tier */
+static const guint32 up_history_rollup_widths[UP_HISTORY_ROLLUP_TIERS] = {
+	60,
+	15 * 60,
+	60 * 60,
+};
+
 /**
  * up_history_set_max_data_age:
  **/
@@ -72,17 +177,299 @@ up_history_set_max_data_age (UpHistory *history, guint max_data_age)
 }
 
 /**
- * up_history_array_copy_cb:
+ * up_history_set_tolerance:
+ * @tolerance: the absolute change needed to record a sample
+ * @relative_tolerance: the change needed relative to the last sample, in percent
+ *
+ * Sets how much a value has to change to be recorded. The largest of the
+ * two tolerances is used.
+ **/
+void
+up_history_set_tolerance (UpHistory *history,
+			  UpHistoryType type,
+			  gdouble tolerance,
+			  gdouble relative_tolerance)
+{
+	g_return_if_fail (type < UP_HISTORY_TYPE_UNKNOWN);
+
+	history->priv->tolerance[type] = tolerance;
+	history->priv->relative_tolerance[type] = relative_tolerance;
+}
+
+/**
+ * up_history_set_max_samples:
+ * @max_series_samples: the number of samples kept per series
+ * @max_device_samples: the number of samples kept for all the series
+ *
+ * Sets the limits after which the oldest samples are downsampled.
+ **/
+void
+up_history_set_max_samples (UpHistory *history, guint max_series_samples, guint max_device_samples)
+{
+	history->priv->max_series_samples = max_series_samples;
+	history->priv->max_device_samples = max_device_samples;
+}
+
+/**
+ * up_history_set_max_total_samples:
+ * @max_total_samples: the number of samples kept for all the histories
+ *
+ * Sets the budget of the daemon, which is shared between all histories.
+ **/
+void
+up_history_set_max_total_samples (UpHistory *history, guint max_total_samples)
+{
+	history->priv->max_total_samples = max_total_samples;
+}
+
+/**
+ * up_history_count_samples:
+ *
+ * Updates the number of samples of this history, and of all histories.
+ **/
+static void
+up_history_count_samples (UpHistory *history)
+{
+	guint samples = 0;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		samples += history->priv->series[i].len;
+	up_history_total_samples -= history->priv->samples;
+	up_history_total_samples += samples;
+	history->priv->samples = samples;
+}
+
+/**
+ * up_history_get_memory_size:
+ *
+ * Return value: the memory used by the samples and rollups, in bytes
+ **/
+static gsize
+up_history_get_memory_size (UpHistory *history)
+{
+	gsize size = 0;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		guint tier;
+
+		size += up_history_series_get_size (&history->priv->series[i]);
+		for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++)
+			size += up_history_rollup_get_size (&history->priv->rollup[i][tier]);
+	}
+	size += up_history_series_get_size (&history->priv->transitions);
+	size += history->priv->profile_slabs->len * sizeof (UpHistoryProfileSlab);
+	return size;
+}
+
+/**
+ * up_history_downsample:
+ *
+ * Halves the resolution of the older half of a series.
+ *
+ * Return value: %TRUE if any samples were removed
+ **/
+static gboolean
+up_history_downsample (UpHistory *history, UpHistoryType type)
+{
+	UpHistorySeries *series = &history->priv->series[type];
+	guint saved = series->saved;
+	guint removed;
+
+	removed = up_history_series_downsample (series, series->len / 2);
+	if (removed == 0)
+		return FALSE;
+	g_debug ("downsampled %s history, removing %u samples",
+		 up_history_type_names[type], removed);
+	history->priv->generation[type]++;
+
+	/* the file only differs if saved samples were merged */
+	if (series->saved != saved)
+		history->priv->file_stale = TRUE;
+	up_history_count_samples (history);
+	return TRUE;
+}
+
+/**
+ * up_history_enforce_limits:
+ *
+ * Downsamples the series until the history is within its limits. This
+ * is done as samples are added, including those not saved yet, so that
+ * the limits also hold when saves are rare.
+ **/
+static void
+up_history_enforce_limits (UpHistory *history)
+{
+	UpHistoryPrivate *priv = history->priv;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		if (priv->series[i].len > priv->max_series_samples)
+			up_history_downsample (history, i);
+	}
+
+	/* over the budget of the daemon, histories bigger than their share
+	 * are downsampled as they grow */
+	up_history_count_samples (history);
+	while (priv->samples > priv->max_device_samples ||
+	       (up_history_total_samples > priv->max_total_samples &&
+		priv->samples > priv->max_total_samples / up_history_count)) {
+		guint largest = 0;
+
+		for (i = 1; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			if (priv->series[i].len > priv->series[largest].len)
+				largest = i;
+		}
+		if (!up_history_downsample (history, largest))
+			break;
+	}
+}
+
+/**
+ * up_history_item_new_full:
+ **/
+static UpHistoryItem *
+up_history_item_new_full (guint time_s, gdouble value, UpDeviceState state)
+{
+	UpHistoryItem *item;
+
+	item = up_history_item_new ();
+	up_history_item_set_time (item, time_s);
+	up_history_item_set_value (item, value);
+	up_history_item_set_state (item, state);
+	return item;
+}
+
+/* accumulates samples into the points returned for a history request */
+typedef struct {
+	GPtrArray	*array;
+	guint64		 first;
+	guint64		 span;
+	guint		 max_num;
+	guint64		 bucket;
+	UpDeviceState	 state;
+	guint64		 time_s;
+	gdouble		 value;
+	guint64		 count;
+} UpHistoryResolution;
+
+/* the time range the points of a history request are spread over, shared
+ * by all series of a GetHistoryMulti request so the points line up */
+typedef struct {
+	guint32		 first;
+	guint32		 last;
+} UpHistoryGrid;
+
+/**
+ * up_history_resolution_init:
+ **/
+static void
+up_history_resolution_init (UpHistoryResolution *res, guint32 first, guint32 last, guint max_num)
+{
+	memset (res, 0, sizeof (*res));
+	res->array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	res->first = first;
+	res->span = (guint64) last - first + 1;
+	res->max_num = max_num;
+	res->state = UP_DEVICE_STATE_UNKNOWN;
+}
+
+/**
+ * up_history_resolution_flush:
+ **/
+static void
+up_history_resolution_flush (UpHistoryResolution *res)
+{
+	if (res->count == 0)
+		return;
+	g_ptr_array_add (res->array, up_history_item_new_full (res->time_s / res->count,
+							       res->value / res->count,
+							       res->state));
+	res->count = 0;
+	res->time_s = 0;
+	res->value = 0;
+}
+
+/**
+ * up_history_resolution_add:
+ * @time_s: the time used to select the bucket
+ * @time_sum: the sum of the sample times
+ * @value_sum: the sum of the sample values
+ * @count: the number of samples
+ **/
+static void
+up_history_resolution_add (UpHistoryResolution *res,
+			   guint32 time_s,
+			   guint64 time_sum,
+			   gdouble value_sum,
+			   guint64 count,
+			   UpDeviceState state)
+{
+	guint64 bucket = (time_s - res->first) * res->max_num / res->span;
+
+	/* if state changed or we went over the preset do a new point */
+	if (bucket != res->bucket || state != res->state)
+		up_history_resolution_flush (res);
+	res->bucket = bucket;
+	res->state = state;
+	res->count += count;
+	res->time_s += time_sum;
+	res->value += value_sum;
+}
+
+/**
+ * up_history_array_reverse:
  **/
 static void
-up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
+up_history_array_reverse (GPtrArray *array)
+{
+	guint i;
+
+	for (i = 0; i < array->len / 2; i++) {
+		gpointer tmp = array->pdata[i];
+		array->pdata[i] = array->pdata[array->len - 1 - i];
+		array->pdata[array->len - 1 - i] = tmp;
+	}
+}
+
+/**
+ * up_history_resolution_finish:
+ * @newest_first: %TRUE to return the most recent point first
+ *
+ * Return value: the points
+ **/
+static GPtrArray *
+up_history_resolution_finish (UpHistoryResolution *res, gboolean newest_first)
+{
+	GPtrArray *new = res->array;
+
+	/* only add if nonzero */
+	up_history_resolution_flush (res);
+
+	if (newest_first)
+		up_history_array_reverse (new);
+
+	/* check length */
+	g_debug ("length of array (after) %i", new->len);
+	return new;
+}
+
+/**
+ * up_history_view_get_index:
+ *
+ * Return value: the index in @view of the @i-th point in output order
+ **/
+static inline guint
+up_history_view_get_index (const UpHistorySeriesView *view, gboolean newest_first, guint i)
 {
-	g_ptr_array_add (dest, g_object_ref (item));
+	return newest_first ? view->len - 1 - i : i;
 }
 
 /**
  * up_history_array_limit_resolution:
- * @array: The data we have for a specific graph
+ * @view: The data we have for a specific graph
+ * @newest_first: %TRUE to return the most recent point first
  * @max_num: The max desired points
  *
  * We need to reduce the number of data points else the graph will take a long
@@ -114,10 +501,8 @@ up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
  * 3 = 85,30
  **/
 static GPtrArray *
-up_history_array_limit_resolution (GPtrArray *array, guint max_num)
+up_history_array_limit_resolution (const UpHistorySeriesView *view, gboolean newest_first, guint max_num)
 {
-	UpHistoryItem *item;
-	UpHistoryItem *item_new;
 	guint length;
 	guint i;
 	guint64 last;
@@ -130,63 +515,61 @@ up_history_array_limit_resolution (GPtrArray *array, guint max_num)
 	guint step = 1;
 
 	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	g_debug ("length of array (before) %i", array->len);
+	g_debug ("length of array (before) %i", view->len);
 
-	/* check length */
-	length = array->len;
+	/* check length, no limit is the same as a very high one */
+	length = view->len;
 	if (length == 0)
 		goto out;
-	if (length < max_num) {
+	if (length < max_num || max_num == 0) {
 		/* need to copy array */
-		g_ptr_array_foreach (array, (GFunc) up_history_array_copy_cb, new);
+		for (i = 0; i < length; i++) {
+			guint j = up_history_view_get_index (view, newest_first, i);
+
+			g_ptr_array_add (new, up_history_item_new_full (up_history_series_view_get_time (view, j),
+									up_history_series_view_get_value (view, j),
+									up_history_series_view_get_state (view, j)));
+		}
 		goto out;
 	}
 
 	/* last element */
-	item = (UpHistoryItem *) g_ptr_array_index (array, length-1);
-	last = up_history_item_get_time (item);
-	item = (UpHistoryItem *) g_ptr_array_index (array, 0);
-	first = up_history_item_get_time (item);
+	last = up_history_series_view_get_time (view, up_history_view_get_index (view, newest_first, length - 1));
+	first = up_history_series_view_get_time (view, up_history_view_get_index (view, newest_first, 0));
 
 	/* Reduces the number of points to a pre-set level using a time
 	 * division algorithm so we don't keep diluting the previous
 	 * data with a conventional 1-in-x type algorithm. */
 	for (i = 0; i < length; i++) {
+		guint j = up_history_view_get_index (view, newest_first, i);
+		guint32 item_time = up_history_series_view_get_time (view, j);
+		gdouble item_value = up_history_series_view_get_value (view, j);
+		UpDeviceState item_state = up_history_series_view_get_state (view, j);
 		guint64 preset;
 
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
 		preset = last + ((first - last) * (guint64) step) / max_num;
 
 		/* if state changed or we went over the preset do a new point */
 		if (count > 0 &&
-		    (up_history_item_get_time (item) > preset ||
-		     up_history_item_get_state (item) != state)) {
-			item_new = up_history_item_new ();
-			up_history_item_set_time (item_new, time_s / count);
-			up_history_item_set_value (item_new, value / count);
-			up_history_item_set_state (item_new, state);
-			g_ptr_array_add (new, item_new);
+		    (item_time > preset ||
+		     item_state != state)) {
+			g_ptr_array_add (new, up_history_item_new_full (time_s / count, value / count, state));
 
 			step++;
-			time_s = up_history_item_get_time (item);
-			value = up_history_item_get_value (item);
-			state = up_history_item_get_state (item);
+			time_s = item_time;
+			value = item_value;
+			state = item_state;
 			count = 1;
 		} else {
 			count++;
-			time_s += up_history_item_get_time (item);
-			value += up_history_item_get_value (item);
+			time_s += item_time;
+			value += item_value;
 		}
 	}
 
 	/* only add if nonzero */
-	if (count > 0) {
-		item_new = up_history_item_new ();
-		up_history_item_set_time (item_new, time_s / count);
-		up_history_item_set_value (item_new, value / count);
-		up_history_item_set_state (item_new, state);
-		g_ptr_array_add (new, item_new);
-	}
+	if (count > 0)
+		g_ptr_array_add (new, up_history_item_new_full (time_s / count, value / count, state));
 
 	/* check length */
 	g_debug ("length of array (after) %i", new->len);
@@ -195,403 +578,1796 @@ out:
 }
 
 /**
- * up_history_copy_array_timespan:
+ * up_history_array_limit_resolution_grid:
+ * @view: The data we have for a specific graph
+ * @grid: the time range to spread the points over
+ * @newest_first: %TRUE to return the most recent point first
+ * @max_num: The max desired points
+ *
+ * Does the same as up_history_array_limit_resolution(), but assigns the
+ * samples to fixed time buckets over @grid, so that the points of several
+ * series line up.
  **/
 static GPtrArray *
-up_history_copy_array_timespan (const GPtrArray *array, guint timespan)
+up_history_array_limit_resolution_grid (const UpHistorySeriesView *view, const UpHistoryGrid *grid,
+					gboolean newest_first, guint max_num)
 {
+	UpHistoryResolution res;
 	guint i;
-	UpHistoryItem *item;
-	GPtrArray *array_new;
-	GTimeVal timeval;
-
-	/* no data */
-	if (array->len == 0)
-		return NULL;
 
-	/* no limit on data */
-	if (timespan == 0) {
-		array_new = g_ptr_array_ref ((GPtrArray *) array);
-		goto out;
-	}
+	if (view->len < max_num || max_num == 0)
+		return up_history_array_limit_resolution (view, newest_first, max_num);
 
-	/* new data */
-	array_new = g_ptr_array_new ();
-	g_get_current_time (&timeval);
-	g_debug ("limiting data to last %i seconds", timespan);
+	up_history_resolution_init (&res, grid->first, grid->last, max_num);
+	for (i = 0; i < view->len; i++) {
+		guint32 item_time = up_history_series_view_get_time (view, i);
 
-	/* treat the timespan like a range, and search backwards */
-	timespan *= 0.95f;
-	for (i=array->len-1; i>0; i--) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if (timeval.tv_sec - up_history_item_get_time (item) < timespan)
-			g_ptr_array_add (array_new, g_object_ref (item));
+		up_history_resolution_add (&res, item_time, item_time,
+					   up_history_series_view_get_value (view, i), 1,
+					   up_history_series_view_get_state (view, i));
 	}
-out:
-	return array_new;
+	return up_history_resolution_finish (&res, newest_first);
 }
 
 /**
- * up_history_get_data:
+ * up_history_rollup_limit_resolution:
+ * @rollup: a rollup tier
+ * @since: the time of the oldest bucket to use
+ * @grid: the time range to spread the points over, or %NULL for the
+ *        range of the buckets
+ * @newest_first: %TRUE to return the most recent point first
+ * @max_num: The max desired points
+ *
+ * Does the same as up_history_array_limit_resolution_grid() but using the
+ * precomputed buckets instead of the individual samples.
  **/
-GPtrArray *
-up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+static GPtrArray *
+up_history_rollup_limit_resolution (const UpHistoryRollup *rollup, gint64 since,
+				    const UpHistoryGrid *grid, gboolean newest_first, guint max_num)
 {
-	GPtrArray *array;
-	GPtrArray *array_resolution;
-	const GPtrArray *array_data = NULL;
-
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	UpHistoryResolution res;
+	guint offset;
+	guint i;
 
-	if (history->priv->id == NULL)
-		return NULL;
+	offset = up_history_rollup_find_time (rollup, since);
+	if (offset == rollup->len)
+		return g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+
+	g_debug ("using %u buckets of %us", rollup->len - offset, rollup->width);
+	up_history_resolution_init (&res,
+				    grid != NULL ? grid->first : rollup->first[UP_HISTORY_ROLLUP_IDX (rollup, offset)],
+				    grid != NULL ? grid->last : rollup->last[UP_HISTORY_ROLLUP_IDX (rollup, rollup->len - 1)],
+				    max_num);
+	for (i = offset; i < rollup->len; i++) {
+		guint pos = UP_HISTORY_ROLLUP_IDX (rollup, i);
+		guint32 mid = rollup->first[pos] + (rollup->last[pos] - rollup->first[pos]) / 2;
+
+		up_history_resolution_add (&res, mid, (guint64) mid * rollup->count[pos],
+					   rollup->sum[pos], rollup->count[pos],
+					   rollup->state[pos]);
+	}
+	return up_history_resolution_finish (&res, newest_first);
+}
 
-	if (type == UP_HISTORY_TYPE_CHARGE)
-		array_data = history->priv->data_charge;
-	else if (type == UP_HISTORY_TYPE_RATE)
-		array_data = history->priv->data_rate;
-	else if (type == UP_HISTORY_TYPE_TIME_FULL)
-		array_data = history->priv->data_time_full;
-	else if (type == UP_HISTORY_TYPE_TIME_EMPTY)
-		array_data = history->priv->data_time_empty;
+/**
+ * up_history_array_add_view_item:
+ **/
+static void
+up_history_array_add_view_item (GPtrArray *array, const UpHistorySeriesView *view, guint i)
+{
+	g_ptr_array_add (array, up_history_item_new_full (up_history_series_view_get_time (view, i),
+							  up_history_series_view_get_value (view, i),
+							  up_history_series_view_get_state (view, i)));
+}
 
-	/* not recognised */
-	if (array_data == NULL)
-		return NULL;
+/**
+ * up_history_array_lttb:
+ * @view: The data we have for a specific graph
+ * @newest_first: %TRUE to return the most recent point first
+ * @max_num: The max desired points
+ *
+ * Reduces the number of points using the largest-triangle-three-buckets
+ * algorithm. The samples are split into @max_num - 2 buckets of equal
+ * size, and from each bucket the sample forming the largest triangle with
+ * the previously selected sample and the average of the next bucket is
+ * kept. Unlike averaging this keeps real samples, so short peaks survive.
+ *
+ * Return value: the points
+ **/
+static GPtrArray *
+up_history_array_lttb (const UpHistorySeriesView *view, gboolean newest_first, guint max_num)
+{
+	GPtrArray *new;
+	gdouble every;
+	guint length = view->len;
+	guint a = 0;
+	guint i, j;
 
-	/* only return a certain time */
-	array = up_history_copy_array_timespan (array_data, timespan);
-	if (array == NULL)
-		return NULL;
+	/* the first and the last point are always kept */
+	max_num = MAX (max_num, 3);
+	if (length <= max_num)
+		return up_history_array_limit_resolution (view, newest_first, G_MAXUINT);
 
-	/* only add a certain number of points */
-	array_resolution = up_history_array_limit_resolution (array, resolution);
-	g_ptr_array_unref (array);
+	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	up_history_array_add_view_item (new, view, 0);
+	every = (gdouble) (length - 2) / (max_num - 2);
+	for (i = 0; i < max_num - 2; i++) {
+		guint range_start = (guint) (i * every) + 1;
+		guint range_end = (guint) ((i + 1) * every) + 1;
+		guint avg_start = range_end;
+		guint avg_end = MIN ((guint) ((i + 2) * every) + 1, length);
+		gdouble avg_time = 0.f;
+		gdouble avg_value = 0.f;
+		gdouble a_time, a_value;
+		gdouble max_area = -1.f;
+		guint next = range_start;
+
+		/* average of the next bucket, or the last point */
+		if (avg_start >= avg_end) {
+			avg_start = length - 1;
+			avg_end = length;
+		}
+		for (j = avg_start; j < avg_end; j++) {
+			avg_time += up_history_series_view_get_time (view, j);
+			avg_value += up_history_series_view_get_value (view, j);
+		}
+		avg_time /= avg_end - avg_start;
+		avg_value /= avg_end - avg_start;
+
+		a_time = up_history_series_view_get_time (view, a);
+		a_value = up_history_series_view_get_value (view, a);
+		for (j = range_start; j < MIN (range_end, length - 1); j++) {
+			gdouble area;
+
+			/* twice the area, which is good enough to compare */
+			area = fabs ((a_time - avg_time) * (up_history_series_view_get_value (view, j) - a_value) -
+				     (a_time - up_history_series_view_get_time (view, j)) * (avg_value - a_value));
+			if (area > max_area) {
+				max_area = area;
+				next = j;
+			}
+		}
+		up_history_array_add_view_item (new, view, next);
+		a = next;
+	}
+	up_history_array_add_view_item (new, view, length - 1);
 
-	return array_resolution;
+	if (newest_first)
+		up_history_array_reverse (new);
+	g_debug ("length of array (after) %i", new->len);
+	return new;
 }
 
 /**
- * up_history_get_profile_data:
+ * up_history_array_minmax:
+ * @view: The data we have for a specific graph
+ * @newest_first: %TRUE to return the most recent point first
+ * @max_num: The max desired points
+ *
+ * Reduces the number of points by splitting the time range into
+ * @max_num / 2 buckets and keeping the lowest and the highest sample of
+ * each, in time order, so the envelope of the data is preserved. As with
+ * up_history_array_limit_resolution_grid(), a new bucket is started whenever
+ * the state changes.
+ *
+ * Return value: the points
  **/
-GPtrArray *
-up_history_get_profile_data (UpHistory *history, gboolean charging)
+static GPtrArray *
+up_history_array_minmax (const UpHistorySeriesView *view, gboolean newest_first, guint max_num)
 {
+	GPtrArray *new;
+	guint32 first, last;
+	guint64 span;
+	guint buckets;
+	guint length = view->len;
+	guint bucket = 0;
+	guint min_idx = 0;
+	guint max_idx = 0;
+	gboolean active = FALSE;
 	guint i;
-	guint non_zero_accuracy = 0;
-	gfloat average = 0.0f;
-	guint bin;
-	guint oldbin = 999;
-	UpHistoryItem *item_last = NULL;
-	UpHistoryItem *item;
-	UpHistoryItem *item_old = NULL;
-	UpStatsItem *stats;
-	GPtrArray *array;
-	GPtrArray *data;
-	guint time_s;
-	gdouble value;
-	gdouble total_value = 0.0f;
-
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
 
-	/* create 100 item list and set to zero */
-	data = g_ptr_array_new_full (101, g_object_unref);
-	for (i=0; i<101; i++) {
-		stats = up_stats_item_new ();
-		g_ptr_array_add (data, stats);
-	}
+	if (length <= MAX (max_num, 2))
+		return up_history_array_limit_resolution (view, newest_first, G_MAXUINT);
 
-	array = history->priv->data_charge;
-	for (i=0; i<array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if (item_last == NULL ||
-		    up_history_item_get_state (item) != up_history_item_get_state (item_last)) {
-			item_old = NULL;
-			goto cont;
+	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	buckets = MAX (max_num / 2, 1);
+	first = up_history_series_view_get_time (view, 0);
+	last = up_history_series_view_get_time (view, length - 1);
+	span = MAX (last - first, 1);
+	for (i = 0; i < length; i++) {
+		guint32 item_time = up_history_series_view_get_time (view, i);
+		gdouble value = up_history_series_view_get_value (view, i);
+		guint item_bucket = MIN ((item_time - first) * (guint64) buckets / span, buckets - 1);
+
+		if (active &&
+		    (item_bucket != bucket ||
+		     up_history_series_view_get_state (view, i) != up_history_series_view_get_state (view, min_idx))) {
+			up_history_array_add_view_item (new, view, MIN (min_idx, max_idx));
+			if (min_idx != max_idx)
+				up_history_array_add_view_item (new, view, MAX (min_idx, max_idx));
+			active = FALSE;
 		}
-
-		/* round to the nearest int */
-		bin = rint (up_history_item_get_value (item));
-
-		/* ensure bin is in range */
-		if (bin >= data->len)
-			bin = data->len - 1;
-
-		/* different */
-		if (oldbin != bin) {
-			oldbin = bin;
-			if (item_old != NULL) {
-				/* not enough or too much difference */
-				value = fabs (up_history_item_get_value (item) - up_history_item_get_value (item_old));
-				if (value < 0.01f) {
-					item_old = NULL;
-					goto cont;
-				}
-				if (value > 3.0f) {
-					item_old = NULL;
-					goto cont;
-				}
-
-				time_s = up_history_item_get_time (item) - up_history_item_get_time (item_old);
-				/* use the accuracy field as a counter for now */
-				if ((charging && up_history_item_get_state (item) == UP_DEVICE_STATE_CHARGING) ||
-				    (!charging && up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)) {
-					stats = (UpStatsItem *) g_ptr_array_index (data, bin);
-					up_stats_item_set_value (stats, up_stats_item_get_value (stats) + time_s);
-					up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) + 1);
-				}
-			}
-			item_old = item;
+		if (!active) {
+			bucket = item_bucket;
+			min_idx = i;
+			max_idx = i;
+			active = TRUE;
+			continue;
 		}
-cont:
-		item_last = item;
+		if (value < up_history_series_view_get_value (view, min_idx))
+			min_idx = i;
+		if (value > up_history_series_view_get_value (view, max_idx))
+			max_idx = i;
 	}
-
-	/* divide the value by the number of samples to make the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) != 0)
-			up_stats_item_set_value (stats, up_stats_item_get_value (stats) / up_stats_item_get_accuracy (stats));
+	if (active) {
+		up_history_array_add_view_item (new, view, MIN (min_idx, max_idx));
+		if (min_idx != max_idx)
+			up_history_array_add_view_item (new, view, MAX (min_idx, max_idx));
 	}
 
-	/* find non-zero accuracy values for the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0) {
-			total_value += up_stats_item_get_value (stats);
-			non_zero_accuracy++;
-		}
-	}
+	if (newest_first)
+		up_history_array_reverse (new);
+	g_debug ("length of array (after) %i", new->len);
+	return new;
+}
 
-	/* average */
-	if (non_zero_accuracy != 0)
-		average = total_value / non_zero_accuracy;
-	g_debug ("average is %f", average);
+/**
+ * up_history_resolution_mode_from_string:
+ *
+ * Return value: the mode, or %UP_HISTORY_RESOLUTION_MODE_UNKNOWN
+ **/
+UpHistoryResolutionMode
+up_history_resolution_mode_from_string (const gchar *mode)
+{
+	if (mode == NULL || mode[0] == '\0' || g_strcmp0 (mode, "average") == 0)
+		return UP_HISTORY_RESOLUTION_MODE_AVERAGE;
+	if (g_strcmp0 (mode, "lttb") == 0)
+		return UP_HISTORY_RESOLUTION_MODE_LTTB;
+	if (g_strcmp0 (mode, "minmax") == 0)
+		return UP_HISTORY_RESOLUTION_MODE_MINMAX;
+	return UP_HISTORY_RESOLUTION_MODE_UNKNOWN;
+}
 
-	/* make the values a factor of 0, so that 1.0 is twice the
-	 * average, and -1.0 is half the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0)
-			up_stats_item_set_value (stats, (up_stats_item_get_value (stats) - average) / average);
-		else
-			up_stats_item_set_value (stats, 0.0f);
+/**
+ * up_history_get_data_view:
+ * @view: the view to set up
+ *
+ * Sets @view to the samples returned for @timespan. Without a timespan
+ * this is the whole series, otherwise the samples of the last @timespan
+ * seconds, but never the oldest sample of the series.
+ *
+ * Return value: the time of the oldest sample to return
+ **/
+static gint64
+up_history_get_data_view (UpHistory *history, UpHistoryType type, guint timespan, UpHistorySeriesView *view)
+{
+	gint64 since = 0;
+
+	/* treat the timespan like a range and only return a certain time */
+	if (timespan > 0) {
+		g_debug ("limiting data to last %i seconds", timespan);
+		since = g_get_real_time () / G_USEC_PER_SEC - (gint64) (timespan * 0.95f) + 1;
 	}
+	up_history_series_slice (&history->priv->series[type], since, view);
+	if (timespan > 0 && view->offset == 0 && view->len > 0) {
+		view->offset++;
+		view->len--;
+	}
+	return since;
+}
 
-	/* accuracy is a percentage scale, where each cycle = 20% */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) * 20.0f);
+/**
+ * up_history_get_view_data:
+ * @view: the samples of the series within the window
+ * @since: the start of the window
+ * @grid: the time range to spread the points over, or %NULL
+ *
+ * Return value: the points for @view, with the most recent point first
+ *               if there is a @timespan, and the oldest first otherwise
+ **/
+static GPtrArray *
+up_history_get_view_data (UpHistory *history,
+			  UpHistoryType type,
+			  const UpHistorySeriesView *view,
+			  gint64 since,
+			  guint timespan,
+			  const UpHistoryGrid *grid,
+			  guint resolution,
+			  UpHistoryResolutionMode mode)
+{
+	gboolean newest_first = timespan > 0;
+
+	/* the shape preserving modes need the individual samples */
+	if (resolution > 0 && view->len > resolution) {
+		if (mode == UP_HISTORY_RESOLUTION_MODE_LTTB)
+			return up_history_array_lttb (view, newest_first, resolution);
+		if (mode == UP_HISTORY_RESOLUTION_MODE_MINMAX)
+			return up_history_array_minmax (view, newest_first, resolution);
 	}
 
-	return data;
+	/* answer from the coarsest rollup that still has enough buckets */
+	if (resolution > 0 && view->len > resolution) {
+		guint64 span = timespan;
+		gint tier;
+
+		if (span == 0 && grid != NULL)
+			span = grid->last - grid->first;
+		else if (span == 0)
+			span = up_history_series_view_get_time (view, view->len - 1) -
+			       up_history_series_view_get_time (view, 0);
+		for (tier = UP_HISTORY_ROLLUP_TIERS - 1; tier >= 0; tier--) {
+			const UpHistoryRollup *rollup = &history->priv->rollup[type][tier];
+
+			if ((guint64) rollup->width * resolution <= span)
+				return up_history_rollup_limit_resolution (rollup, since, grid,
+									   newest_first, resolution);
+		}
+	}
+
+	/* only add a certain number of points */
+	if (grid != NULL)
+		return up_history_array_limit_resolution_grid (view, grid, newest_first, resolution);
+	return up_history_array_limit_resolution (view, newest_first, resolution);
 }
 
 /**
- * up_history_get_filename:
+ * up_history_get_data_full:
+ * @mode: how to reduce the data to @resolution points
+ *
+ * Return value: the data of the last @timespan seconds, with the most
+ *               recent point first, or all data with the oldest first
  **/
-static gchar *
-up_history_get_filename (UpHistory *history, const gchar *type)
+GPtrArray *
+up_history_get_data_full (UpHistory *history, UpHistoryType type, guint timespan,
+			  guint resolution, UpHistoryResolutionMode mode)
 {
-	gchar *path;
-	gchar *filename;
+	UpHistorySeriesView view;
+	gint64 since;
 
-	filename = g_strdup_printf ("history-%s-%s.dat", type, history->priv->id);
-	path = g_build_filename (history->priv->dir, filename, NULL);
-	g_free (filename);
-	return path;
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+
+	/* not recognised */
+	if (type >= UP_HISTORY_TYPE_UNKNOWN)
+		return NULL;
+
+	/* no data */
+	if (history->priv->series[type].len == 0)
+		return NULL;
+
+	since = up_history_get_data_view (history, type, timespan, &view);
+	return up_history_get_view_data (history, type, &view, since, timespan,
+					 NULL, resolution, mode);
+}
+
+/**
+ * up_history_get_data:
+ *
+ * Return value: the data of the last @timespan seconds, with the most
+ *               recent point first, or all data with the oldest first
+ **/
+GPtrArray *
+up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+{
+	return up_history_get_data_full (history, type, timespan, resolution,
+					 UP_HISTORY_RESOLUTION_MODE_AVERAGE);
+}
+
+/**
+ * up_history_get_data_multi:
+ * @types: the series to return
+ * @n_types: the number of entries in @types
+ *
+ * Does the same as up_history_get_data() for several series at once, but
+ * spreads the points of all of them over the same time range so that
+ * they line up when drawn together.
+ *
+ * Return value: an array with the points of each series in @types, or
+ *               %NULL if the history is not set up
+ **/
+GPtrArray *
+up_history_get_data_multi (UpHistory *history, const UpHistoryType *types, guint n_types,
+			   guint timespan, guint resolution)
+{
+	UpHistorySeriesView *views;
+	UpHistoryGrid grid = { G_MAXUINT32, 0 };
+	GPtrArray *result;
+	gint64 since = 0;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	for (i = 0; i < n_types; i++)
+		g_return_val_if_fail (types[i] < UP_HISTORY_TYPE_UNKNOWN, NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+
+	/* find the time range covered by all series */
+	views = g_new0 (UpHistorySeriesView, n_types);
+	for (i = 0; i < n_types; i++) {
+		since = up_history_get_data_view (history, types[i], timespan, &views[i]);
+		if (views[i].len == 0)
+			continue;
+		grid.first = MIN (grid.first, up_history_series_view_get_time (&views[i], 0));
+		grid.last = MAX (grid.last, up_history_series_view_get_time (&views[i], views[i].len - 1));
+	}
+
+	result = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+	for (i = 0; i < n_types; i++) {
+		g_ptr_array_add (result, up_history_get_view_data (history, types[i], &views[i],
+								   since, timespan, &grid, resolution,
+								   UP_HISTORY_RESOLUTION_MODE_AVERAGE));
+	}
+	g_free (views);
+	return result;
+}
+
+/**
+ * up_history_get_generation:
+ *
+ * Return value: a counter that changes whenever the data of the series
+ *               changes, so that results derived from it can be cached
+ **/
+guint
+up_history_get_generation (UpHistory *history, UpHistoryType type)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), 0);
+	g_return_val_if_fail (type < UP_HISTORY_TYPE_UNKNOWN, 0);
+
+	return history->priv->generation[type];
+}
+
+/**
+ * up_history_get_data_expiry:
+ *
+ * Return value: the time in seconds at which the oldest point returned by
+ *               up_history_get_data() for @timespan drops out of the window,
+ *               or %G_MAXINT64 if the result only changes with new data
+ **/
+gint64
+up_history_get_data_expiry (UpHistory *history, UpHistoryType type, guint timespan)
+{
+	UpHistorySeriesView view;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), 0);
+	g_return_val_if_fail (type < UP_HISTORY_TYPE_UNKNOWN, 0);
+
+	if (timespan == 0)
+		return G_MAXINT64;
+
+	/* this has to match the window used in up_history_get_data() */
+	up_history_get_data_view (history, type, timespan, &view);
+	if (view.len == 0)
+		return G_MAXINT64;
+	return (gint64) up_history_series_view_get_time (&view, 0) + (gint64) (timespan * 0.95f);
+}
+
+/**
+ * up_history_get_range:
+ * @start: the time of the oldest sample to return
+ * @end: the time after the newest sample to return, or 0 for no limit
+ * @max_points: the maximum number of samples to return, or 0 for no limit
+ * @state: only return samples in this state, or %UP_DEVICE_STATE_UNKNOWN
+ *         for all of them
+ * @next: (out): the @start of the next page, or 0 if there is none
+ *
+ * Returns the samples in an absolute time range. The start of the range is
+ * found with a binary search, so fetching just the samples added since the
+ * last call is cheap. A page never ends in the middle of a second, as
+ * @next could not tell those samples apart; a single second with more than
+ * @max_points samples is returned in full.
+ *
+ * Return value: the samples, with the oldest first
+ **/
+GPtrArray *
+up_history_get_range (UpHistory *history, UpHistoryType type, guint32 start, guint32 end,
+		      guint max_points, UpDeviceState state, guint32 *next)
+{
+	const UpHistorySeries *series;
+	GPtrArray *array;
+	guint first, last;
+	guint count = 0;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	g_return_val_if_fail (next != NULL, NULL);
+
+	*next = 0;
+	if (history->priv->id == NULL || type >= UP_HISTORY_TYPE_UNKNOWN)
+		return NULL;
+
+	series = &history->priv->series[type];
+	first = up_history_series_find_time (series, start);
+	last = end > 0 ? up_history_series_find_time (series, end) : series->len;
+	if (max_points == 0)
+		max_points = G_MAXUINT;
+
+	/* find the end of the page */
+	for (i = first; i < last; i++) {
+		if (state != UP_DEVICE_STATE_UNKNOWN &&
+		    up_history_series_get_state (series, i) != state)
+			continue;
+		if (count == max_points)
+			break;
+		count++;
+	}
+	if (i < last) {
+		guint32 boundary = up_history_series_get_time (series, i);
+		guint cut = up_history_series_find_time (series, boundary);
+
+		/* back off to the start of the second, unless that is all */
+		if (cut > first) {
+			i = cut;
+		} else {
+			while (i < last && up_history_series_get_time (series, i) == boundary)
+				i++;
+		}
+		if (i < last)
+			*next = up_history_series_get_time (series, i);
+	}
+	last = i;
+
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = first; i < last; i++) {
+		if (state != UP_DEVICE_STATE_UNKNOWN &&
+		    up_history_series_get_state (series, i) != state)
+			continue;
+		g_ptr_array_add (array, up_history_item_new_full (up_history_series_get_time (series, i),
+								  up_history_series_get_value (series, i),
+								  up_history_series_get_state (series, i)));
+	}
+	return array;
+}
+
+/**
+ * up_history_get_transitions:
+ * @start: the time of the oldest transition to return
+ * @end: the time after the newest transition to return, or 0 for no limit
+ *
+ * Returns the points at which the state of the device changed, with the
+ * charge at that time, so that questions like the time since the last
+ * full charge do not need a scan of the charge history.
+ *
+ * Return value: the transitions, with the oldest first
+ **/
+GPtrArray *
+up_history_get_transitions (UpHistory *history, guint32 start, guint32 end)
+{
+	const UpHistorySeries *transitions;
+	GPtrArray *array;
+	guint first, last;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+
+	transitions = &history->priv->transitions;
+	first = up_history_series_find_time (transitions, start);
+	last = end > 0 ? up_history_series_find_time (transitions, end) : transitions->len;
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	for (i = first; i < last; i++)
+		g_ptr_array_add (array, up_history_item_new_full (up_history_series_get_time (transitions, i),
+								  up_history_series_get_value (transitions, i),
+								  up_history_series_get_state (transitions, i)));
+	return array;
+}
+
+/**
+ * up_history_get_statistics:
+ * @charging: %TRUE for the charging profile, %FALSE for discharging
+ * @bin_width: the number of percentage points per bin
+ * @timespan: only use the samples of about the last @timespan seconds,
+ *            or 0 for all of them
+ *
+ * Does the same as up_history_get_profile_data(), but with configurable
+ * bins over a time window, from the sums kept per day. The window is
+ * rounded up to whole days.
+ *
+ * Return value: (element-type UpHistoryStatisticsBin): the bins, starting
+ *               at 0%, or %NULL if the history is not set up
+ **/
+GArray *
+up_history_get_statistics (UpHistory *history, gboolean charging, guint bin_width, guint timespan)
+{
+	UpHistoryProfileKind kind;
+	GArray *slabs;
+	GArray *bins;
+	gint64 since = 0;
+	guint first;
+	guint i, j;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	g_return_val_if_fail (bin_width > 0, NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+
+	kind = charging ? UP_HISTORY_PROFILE_CHARGING : UP_HISTORY_PROFILE_DISCHARGING;
+	bins = g_array_new (FALSE, TRUE, sizeof (UpHistoryStatisticsBin));
+	g_array_set_size (bins, (UP_HISTORY_PROFILE_BINS + bin_width - 1) / bin_width);
+	for (i = 0; i < bins->len; i++)
+		g_array_index (bins, UpHistoryStatisticsBin, i).percentage = i * bin_width;
+
+	/* sum up the slabs in the window, then the percentage points per bin */
+	slabs = history->priv->profile_slabs;
+	if (timespan > 0)
+		since = g_get_real_time () / G_USEC_PER_SEC - timespan;
+	for (first = 0; first < slabs->len; first++) {
+		if ((gint64) g_array_index (slabs, UpHistoryProfileSlab, first).start +
+		    UP_HISTORY_PROFILE_SLAB_WIDTH > since)
+			break;
+	}
+	for (i = first; i < slabs->len; i++) {
+		const UpHistoryProfileSlab *slab = &g_array_index (slabs, UpHistoryProfileSlab, i);
+
+		for (j = 0; j < UP_HISTORY_PROFILE_BINS; j++) {
+			UpHistoryStatisticsBin *bin = &g_array_index (bins, UpHistoryStatisticsBin, j / bin_width);
+
+			bin->count += slab->count[kind][j];
+			bin->mean += slab->sum[kind][j];
+			bin->variance += slab->sumsq[kind][j];
+		}
+	}
+
+	/* turn the sums into the mean and the variance */
+	for (i = 0; i < bins->len; i++) {
+		UpHistoryStatisticsBin *bin = &g_array_index (bins, UpHistoryStatisticsBin, i);
+
+		if (bin->count == 0)
+			continue;
+		bin->mean /= bin->count;
+		bin->variance = MAX (bin->variance / bin->count - bin->mean * bin->mean, 0.f);
+	}
+	return bins;
+}
+
+/**
+ * up_history_get_profile_data:
+ **/
+GPtrArray *
+up_history_get_profile_data (UpHistory *history, gboolean charging)
+{
+	guint i;
+	guint non_zero_accuracy = 0;
+	gfloat average = 0.0f;
+	UpHistoryProfileKind kind;
+	const UpHistoryProfile *profile;
+	UpStatsItem *stats;
+	GPtrArray *data;
+	gdouble total_value = 0.0f;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	/* the bins are kept up to date as the charge data comes in */
+	profile = &history->priv->profile;
+	kind = charging ? UP_HISTORY_PROFILE_CHARGING : UP_HISTORY_PROFILE_DISCHARGING;
+
+	/* find non-zero accuracy values for the average */
+	for (i=0; i<UP_HISTORY_PROFILE_BINS; i++) {
+		if (profile->count[kind][i] > 0) {
+			total_value += profile->sum[kind][i] / profile->count[kind][i];
+			non_zero_accuracy++;
+		}
+	}
+
+	/* average */
+	if (non_zero_accuracy != 0)
+		average = total_value / non_zero_accuracy;
+	g_debug ("average is %f", average);
+
+	data = g_ptr_array_new_full (UP_HISTORY_PROFILE_BINS, g_object_unref);
+	for (i=0; i<UP_HISTORY_PROFILE_BINS; i++) {
+		stats = up_stats_item_new ();
+
+		/* make the values a factor of 0, so that 1.0 is twice the
+		 * average, and -1.0 is half the average */
+		if (profile->count[kind][i] > 0)
+			up_stats_item_set_value (stats, (profile->sum[kind][i] / profile->count[kind][i] - average) / average);
+
+		/* accuracy is a percentage scale, where each cycle = 20% */
+		up_stats_item_set_accuracy (stats, profile->count[kind][i] * 20.0f);
+		g_ptr_array_add (data, stats);
+	}
+
+	return data;
+}
+
+/**
+ * up_history_get_profile_time:
+ * @charging: %TRUE for the charging profile, %FALSE for discharging
+ * @from: the lower percentage
+ * @to: the upper percentage
+ *
+ * Uses the time per percentage point learned from the charge data of this
+ * battery to estimate how long it takes to get between two percentages.
+ *
+ * Return value: the time in seconds, or 0 if not enough is known
+ **/
+gint64
+up_history_get_profile_time (UpHistory *history, gboolean charging, gdouble from, gdouble to)
+{
+	gdouble time;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), 0);
+
+	if (history->priv->id == NULL)
+		return 0;
+	time = up_history_profile_get_time (&history->priv->profile,
+					    charging ? UP_HISTORY_PROFILE_CHARGING : UP_HISTORY_PROFILE_DISCHARGING,
+					    from, to);
+	return time > 0 ? (gint64) time : 0;
+}
+
+/**
+ * up_history_get_filename:
+ **/
+static gchar *
+up_history_get_filename (UpHistory *history)
+{
+	gchar *path;
+	gchar *filename;
+
+	filename = g_strdup_printf ("history-%s.uph", history->priv->id);
+	path = g_build_filename (history->priv->dir, filename, NULL);
+	g_free (filename);
+	return path;
+}
+
+/**
+ * up_history_get_journal_filename:
+ * @suffix: "journal", or "journal.old" for the saves in flight
+ **/
+static gchar *
+up_history_get_journal_filename (UpHistory *history, const gchar *suffix)
+{
+	gchar *path;
+	gchar *filename;
+
+	filename = g_strdup_printf ("history-%s.%s", history->priv->id, suffix);
+	path = g_build_filename (history->priv->journal_dir, filename, NULL);
+	g_free (filename);
+	return path;
+}
+
+/**
+ * up_history_get_old_filename:
+ * @type: the series, or "profile"
+ * @suffix: "dat" for the text format, or "bin" and "rollup" for the
+ *          per-series binary files
+ *
+ * Return value: the name of a file used by older versions
+ **/
+static gchar *
+up_history_get_old_filename (UpHistory *history, const gchar *type, const gchar *suffix)
+{
+	gchar *path;
+	gchar *filename;
+
+	filename = g_strdup_printf ("history-%s-%s.%s", type, history->priv->id, suffix);
+	path = g_build_filename (history->priv->dir, filename, NULL);
+	g_free (filename);
+	return path;
 }
 
 /**
  * up_history_set_directory:
  **/
-void
-up_history_set_directory (UpHistory *history, const gchar *dir)
+void
+up_history_set_directory (UpHistory *history, const gchar *dir)
+{
+	g_free (history->priv->dir);
+	history->priv->dir = g_strdup (dir);
+	g_mkdir_with_parents (dir, 0755);
+}
+
+/**
+ * up_history_set_journal_directory:
+ * @dir: a directory on a tmpfs, which is created when needed
+ **/
+void
+up_history_set_journal_directory (UpHistory *history, const gchar *dir)
+{
+	g_free (history->priv->journal_dir);
+	history->priv->journal_dir = g_strdup (dir);
+}
+
+/**
+ * up_history_check_header:
+ **/
+static gboolean
+up_history_check_header (const guint8 *data, gsize length, const gchar *magic,
+			 guint32 record_size, const gchar *filename)
+{
+	guint32 tmp;
+
+	if (length < UP_HISTORY_SERIES_HEADER_SIZE ||
+	    memcmp (data, magic, 4) != 0) {
+		g_warning ("%s is not a history file", filename);
+		return FALSE;
+	}
+	memcpy (&tmp, data + 4, 4);
+	if (GUINT32_FROM_LE (tmp) != UP_HISTORY_SERIES_VERSION) {
+		g_warning ("%s has unsupported version %u", filename, GUINT32_FROM_LE (tmp));
+		return FALSE;
+	}
+	memcpy (&tmp, data + 8, 4);
+	if (GUINT32_FROM_LE (tmp) != record_size) {
+		g_warning ("%s has unsupported record size %u", filename, GUINT32_FROM_LE (tmp));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_read_record:
+ **/
+static void
+up_history_read_record (const guint8 *record, guint32 *time_s, gdouble *value, UpDeviceState *state)
+{
+	guint32 time_le;
+	guint64 value_le;
+
+	memcpy (&time_le, record, 4);
+	memcpy (&value_le, record + 4, 8);
+	*time_s = GUINT32_FROM_LE (time_le);
+	value_le = GUINT64_FROM_LE (value_le);
+	memcpy (value, &value_le, sizeof (value_le));
+	*state = record[12];
+}
+
+/**
+ * up_history_read_series:
+ * @since: the time of the oldest record to keep
+ *
+ * Appends the records in @data to the list
+ *
+ * Return value: the number of records older than @since
+ **/
+static guint
+up_history_read_series (UpHistorySeries *list, const guint8 *data, gsize length, gint64 since)
+{
+	guint skipped = 0;
+	gsize i;
+
+	for (i = 0; i + UP_HISTORY_RECORD_SIZE <= length; i += UP_HISTORY_RECORD_SIZE) {
+		guint32 time_s;
+		gdouble value;
+		UpDeviceState state;
+
+		up_history_read_record (data + i, &time_s, &value, &state);
+		if (time_s < since) {
+			skipped++;
+			continue;
+		}
+		up_history_series_append (list, time_s, value, state);
+	}
+	return skipped;
+}
+
+/**
+ * up_history_write_rollup:
+ *
+ * Encodes the complete buckets of a tier that are not saved yet.
+ **/
+static void
+up_history_write_rollup (GByteArray *buf, const UpHistoryRollup *rollup, guint8 tier)
+{
+	guint8 record[UP_HISTORY_ROLLUP_RECORD_SIZE];
+	guint i;
+
+	/* the last bucket may still change */
+	for (i = rollup->saved; i + 1 < rollup->len; i++) {
+		guint pos = UP_HISTORY_ROLLUP_IDX (rollup, i);
+		guint32 tmp32;
+		guint64 tmp64;
+
+		record[0] = tier;
+		record[1] = rollup->state[pos];
+		tmp32 = GUINT32_TO_LE (rollup->first[pos]);
+		memcpy (record + 2, &tmp32, 4);
+		tmp32 = GUINT32_TO_LE (rollup->last[pos]);
+		memcpy (record + 6, &tmp32, 4);
+		tmp32 = GUINT32_TO_LE (rollup->count[pos]);
+		memcpy (record + 10, &tmp32, 4);
+		memcpy (&tmp64, &rollup->sum[pos], 8);
+		tmp64 = GUINT64_TO_LE (tmp64);
+		memcpy (record + 14, &tmp64, 8);
+		memcpy (&tmp64, &rollup->min[pos], 8);
+		tmp64 = GUINT64_TO_LE (tmp64);
+		memcpy (record + 22, &tmp64, 8);
+		memcpy (&tmp64, &rollup->max[pos], 8);
+		tmp64 = GUINT64_TO_LE (tmp64);
+		memcpy (record + 30, &tmp64, 8);
+		g_byte_array_append (buf, record, sizeof (record));
+	}
+}
+
+/**
+ * up_history_read_rollup:
+ * @since: the time of the oldest sample to keep
+ *
+ * Return value: the number of buckets that only have older samples
+ **/
+static guint
+up_history_read_rollup (UpHistoryRollup *rollups, const guint8 *data, gsize length, gint64 since)
+{
+	guint skipped = 0;
+	gsize i;
+
+	for (i = 0; i + UP_HISTORY_ROLLUP_RECORD_SIZE <= length; i += UP_HISTORY_ROLLUP_RECORD_SIZE) {
+		const guint8 *record = data + i;
+		guint32 first, last, count;
+		guint64 tmp64;
+		gdouble sum, min, max;
+
+		if (record[0] >= UP_HISTORY_ROLLUP_TIERS)
+			continue;
+		memcpy (&first, record + 2, 4);
+		memcpy (&last, record + 6, 4);
+		memcpy (&count, record + 10, 4);
+		memcpy (&tmp64, record + 14, 8);
+		tmp64 = GUINT64_FROM_LE (tmp64);
+		memcpy (&sum, &tmp64, 8);
+		memcpy (&tmp64, record + 22, 8);
+		tmp64 = GUINT64_FROM_LE (tmp64);
+		memcpy (&min, &tmp64, 8);
+		memcpy (&tmp64, record + 30, 8);
+		tmp64 = GUINT64_FROM_LE (tmp64);
+		memcpy (&max, &tmp64, 8);
+		if (GUINT32_FROM_LE (last) < since) {
+			skipped++;
+			continue;
+		}
+		up_history_rollup_append_bucket (&rollups[record[0]],
+						 GUINT32_FROM_LE (first),
+						 GUINT32_FROM_LE (last),
+						 GUINT32_FROM_LE (count),
+						 sum, min, max, record[1]);
+	}
+	return skipped;
+}
+
+/**
+ * up_history_rollup_catch_up:
+ *
+ * Adds the samples that are newer than the stored buckets.
+ **/
+static void
+up_history_rollup_catch_up (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	guint tier;
+
+	for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++) {
+		UpHistoryRollup *rollup = &history->priv->rollup[type][tier];
+		gint64 since = 0;
+		guint i;
+
+		rollup->saved = rollup->len;
+		if (rollup->len > 0)
+			since = (gint64) rollup->last[UP_HISTORY_ROLLUP_IDX (rollup, rollup->len - 1)] + 1;
+		for (i = up_history_series_find_time (series, since); i < series->len; i++)
+			up_history_rollup_add (rollup,
+					       up_history_series_get_time (series, i),
+					       up_history_series_get_value (series, i),
+					       up_history_series_get_state (series, i));
+	}
+}
+
+/**
+ * up_history_write_profile:
+ **/
+static void
+up_history_write_profile (GByteArray *buf, const UpHistoryProfile *profile)
+{
+	guint8 state[UP_HISTORY_PROFILE_STATE_SIZE];
+	guint8 record[UP_HISTORY_PROFILE_RECORD_SIZE];
+	guint32 tmp32;
+	guint64 tmp64;
+	guint kind;
+	guint i;
+
+	tmp32 = GUINT32_TO_LE (profile->covered);
+	memcpy (state, &tmp32, 4);
+	tmp32 = GUINT32_TO_LE (profile->last_state);
+	memcpy (state + 4, &tmp32, 4);
+	tmp32 = GUINT32_TO_LE (profile->oldbin);
+	memcpy (state + 8, &tmp32, 4);
+	tmp32 = GUINT32_TO_LE (profile->has_old);
+	memcpy (state + 12, &tmp32, 4);
+	tmp32 = GUINT32_TO_LE (profile->old_time);
+	memcpy (state + 16, &tmp32, 4);
+	memcpy (&tmp64, &profile->old_value, 8);
+	tmp64 = GUINT64_TO_LE (tmp64);
+	memcpy (state + 20, &tmp64, 8);
+	g_byte_array_append (buf, state, sizeof (state));
+
+	for (kind = 0; kind < UP_HISTORY_PROFILE_LAST; kind++) {
+		for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+			memcpy (&tmp64, &profile->sum[kind][i], 8);
+			tmp64 = GUINT64_TO_LE (tmp64);
+			memcpy (record, &tmp64, 8);
+			tmp32 = GUINT32_TO_LE (profile->count[kind][i]);
+			memcpy (record + 8, &tmp32, 4);
+			g_byte_array_append (buf, record, sizeof (record));
+		}
+	}
+}
+
+/**
+ * up_history_read_profile:
+ **/
+static gboolean
+up_history_read_profile (UpHistoryProfile *profile, const guint8 *data, gsize length)
+{
+	guint32 tmp32;
+	guint64 tmp64;
+	guint kind;
+	guint i;
+
+	if (length != UP_HISTORY_PROFILE_STATE_SIZE +
+		      UP_HISTORY_PROFILE_LAST * UP_HISTORY_PROFILE_BINS * UP_HISTORY_PROFILE_RECORD_SIZE) {
+		g_warning ("charge profile has an invalid size");
+		return FALSE;
+	}
+
+	memcpy (&tmp32, data, 4);
+	profile->covered = GUINT32_FROM_LE (tmp32);
+	memcpy (&tmp32, data + 4, 4);
+	profile->last_state = GUINT32_FROM_LE (tmp32);
+	memcpy (&tmp32, data + 8, 4);
+	profile->oldbin = GUINT32_FROM_LE (tmp32);
+	memcpy (&tmp32, data + 12, 4);
+	profile->has_old = GUINT32_FROM_LE (tmp32) != 0;
+	memcpy (&tmp32, data + 16, 4);
+	profile->old_time = GUINT32_FROM_LE (tmp32);
+	memcpy (&tmp64, data + 20, 8);
+	tmp64 = GUINT64_FROM_LE (tmp64);
+	memcpy (&profile->old_value, &tmp64, 8);
+
+	data += UP_HISTORY_PROFILE_STATE_SIZE;
+	for (kind = 0; kind < UP_HISTORY_PROFILE_LAST; kind++) {
+		for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+			memcpy (&tmp64, data, 8);
+			tmp64 = GUINT64_FROM_LE (tmp64);
+			memcpy (&profile->sum[kind][i], &tmp64, 8);
+			memcpy (&tmp32, data + 8, 4);
+			profile->count[kind][i] = GUINT32_FROM_LE (tmp32);
+			data += UP_HISTORY_PROFILE_RECORD_SIZE;
+		}
+	}
+	profile->dirty = FALSE;
+	return TRUE;
+}
+
+/**
+ * up_history_write_voltage:
+ **/
+static void
+up_history_write_voltage (GByteArray *buf, const UpHistoryVoltage *voltage)
+{
+	guint8 record[UP_HISTORY_VOLTAGE_RECORD_SIZE];
+	guint32 tmp32;
+	guint64 tmp64;
+	guint temp;
+	guint soc;
+
+	for (temp = 0; temp < UP_HISTORY_VOLTAGE_TEMP_BINS; temp++) {
+		for (soc = 0; soc < UP_HISTORY_VOLTAGE_SOC_BINS; soc++) {
+			memcpy (&tmp64, &voltage->mean[temp][soc], 8);
+			tmp64 = GUINT64_TO_LE (tmp64);
+			memcpy (record, &tmp64, 8);
+			tmp32 = GUINT32_TO_LE (voltage->count[temp][soc]);
+			memcpy (record + 8, &tmp32, 4);
+			g_byte_array_append (buf, record, sizeof (record));
+		}
+	}
+}
+
+/**
+ * up_history_read_voltage:
+ **/
+static gboolean
+up_history_read_voltage (UpHistoryVoltage *voltage, const guint8 *data, gsize length)
+{
+	guint32 tmp32;
+	guint64 tmp64;
+	guint temp;
+	guint soc;
+
+	if (length != UP_HISTORY_VOLTAGE_TEMP_BINS * UP_HISTORY_VOLTAGE_SOC_BINS * UP_HISTORY_VOLTAGE_RECORD_SIZE) {
+		g_warning ("voltage table has an invalid size");
+		return FALSE;
+	}
+
+	for (temp = 0; temp < UP_HISTORY_VOLTAGE_TEMP_BINS; temp++) {
+		for (soc = 0; soc < UP_HISTORY_VOLTAGE_SOC_BINS; soc++) {
+			memcpy (&tmp64, data, 8);
+			tmp64 = GUINT64_FROM_LE (tmp64);
+			memcpy (&voltage->mean[temp][soc], &tmp64, 8);
+			memcpy (&tmp32, data + 8, 4);
+			voltage->count[temp][soc] = GUINT32_FROM_LE (tmp32);
+			data += UP_HISTORY_VOLTAGE_RECORD_SIZE;
+		}
+	}
+	up_history_voltage_mark_saved (voltage);
+	return TRUE;
+}
+
+/**
+ * up_history_profile_rebuild:
+ *
+ * Recreates the charge profile from the samples still in the history.
+ **/
+static void
+up_history_profile_rebuild (UpHistory *history)
+{
+	const UpHistorySeries *series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	guint i;
+
+	up_history_profile_init (&history->priv->profile);
+	g_array_set_size (history->priv->profile_slabs, 0);
+	for (i = 0; i < series->len; i++)
+		up_history_profile_add (&history->priv->profile,
+					history->priv->profile_slabs,
+					up_history_series_get_time (series, i),
+					up_history_series_get_value (series, i),
+					up_history_series_get_state (series, i));
+}
+
+/**
+ * up_history_profile_catch_up:
+ *
+ * Adds the charge samples that are newer than the stored profile. The
+ * per day sums are not saved, so they are recreated from all samples.
+ **/
+static void
+up_history_profile_catch_up (UpHistory *history)
+{
+	UpHistoryProfile *profile = &history->priv->profile;
+	UpHistoryProfile scan;
+	const UpHistorySeries *series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	guint i;
+
+	up_history_profile_init (&scan);
+	g_array_set_size (history->priv->profile_slabs, 0);
+	for (i = 0; i < series->len; i++)
+		up_history_profile_add (&scan, history->priv->profile_slabs,
+					up_history_series_get_time (series, i),
+					up_history_series_get_value (series, i),
+					up_history_series_get_state (series, i));
+
+	for (i = up_history_series_find_time (series, (gint64) profile->covered + 1); i < series->len; i++)
+		up_history_profile_add (profile, NULL,
+					up_history_series_get_time (series, i),
+					up_history_series_get_value (series, i),
+					up_history_series_get_state (series, i));
+}
+
+/**
+ * up_history_array_cull:
+ * @list: a valid #UpHistorySeries
+ *
+ * Removes the entries that are older than the maximum data age.
+ *
+ * Return value: the number of removed entries
+ **/
+static guint
+up_history_array_cull (UpHistory *history, UpHistorySeries *list)
+{
+	gint64 time_now;
+	guint cull_count = 0;
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+
+	/* the data is ordered by time, so we only need to look at the start */
+	while (cull_count < list->len) {
+		if (time_now - up_history_series_get_time (list, cull_count) <= history->priv->max_data_age)
+			break;
+		cull_count++;
+	}
+	up_history_series_remove_head (list, cull_count);
+	return cull_count;
+}
+
+/**
+ * up_history_array_needs_compact:
+ **/
+static gboolean
+up_history_array_needs_compact (UpHistory *history, const UpHistorySeries *list)
+{
+	gint64 time_now;
+
+	if (list->len == 0)
+		return FALSE;
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	return time_now - up_history_series_get_time (list, 0) > history->priv->max_data_age;
+}
+
+/**
+ * up_history_array_from_binary_file:
+ * @list: a valid #UpHistorySeries
+ * @filename: a filename
+ *
+ * @since: the time of the oldest entry to keep
+ *
+ * Appends the list from a file in the per-series binary format
+ **/
+static gboolean
+up_history_array_from_binary_file (UpHistorySeries *list, const gchar *filename, gint64 since)
+{
+	GMappedFile *mapped;
+	GError *error = NULL;
+	const guint8 *data;
+	gsize length;
+	gboolean ret = FALSE;
+
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to get data: %s", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+	data = (const guint8 *) g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+
+	/* check the header */
+	if (!up_history_check_header (data, length, UP_HISTORY_SERIES_MAGIC,
+				      UP_HISTORY_RECORD_SIZE, filename))
+		goto out;
+
+	/* a trailing partial record is the result of an interrupted write */
+	g_debug ("loading %" G_GSIZE_FORMAT " items of data from %s",
+		 (length - UP_HISTORY_SERIES_HEADER_SIZE) / UP_HISTORY_RECORD_SIZE, filename);
+	up_history_read_series (list, data + UP_HISTORY_SERIES_HEADER_SIZE,
+				length - UP_HISTORY_SERIES_HEADER_SIZE, since);
+	ret = TRUE;
+out:
+	g_mapped_file_unref (mapped);
+	return ret;
+}
+
+/**
+ * up_history_parse_line:
+ * @line: a line of the legacy text format, not nul terminated
+ * @length: the length of @line, without the line ending
+ *
+ * Parses a line of (time, value, state) separated by tabs, without
+ * allocating memory.
+ *
+ * Return value: %TRUE if the line is valid
+ **/
+static gboolean
+up_history_parse_line (const gchar *line,
+		       gsize length,
+		       guint32 *time_s,
+		       gdouble *value,
+		       UpDeviceState *state)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	const gchar *end = line + length;
+	const gchar *p = line;
+	const gchar *field;
+	gchar *tail;
+	guint64 tmp = 0;
+	guint i;
+
+	/* time */
+	if (p == end || !g_ascii_isdigit (*p))
+		return FALSE;
+	for (; p < end && g_ascii_isdigit (*p); p++) {
+		tmp = tmp * 10 + (*p - '0');
+		if (tmp > G_MAXUINT32)
+			return FALSE;
+	}
+	if (p == end || *p != '\t')
+		return FALSE;
+	*time_s = tmp;
+
+	/* value, copied so that the parser stops at the end */
+	field = ++p;
+	while (p < end && *p != '\t')
+		p++;
+	if (p == end || p == field || (gsize) (p - field) >= sizeof (buf))
+		return FALSE;
+	memcpy (buf, field, p - field);
+	buf[p - field] = '\0';
+	*value = g_ascii_strtod (buf, &tail);
+	if (*tail != '\0')
+		return FALSE;
+
+	/* state */
+	field = ++p;
+	*state = UP_DEVICE_STATE_UNKNOWN;
+	for (i = 0; i < UP_DEVICE_STATE_LAST; i++) {
+		const gchar *name = up_device_state_to_string (i);
+
+		if (strlen (name) == (gsize) (end - field) &&
+		    memcmp (name, field, end - field) == 0) {
+			*state = i;
+			break;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_array_from_file:
+ * @list: a valid #UpHistorySeries
+ * @filename: a filename
+ * @since: the time of the oldest entry to keep
+ *
+ * Appends the list from a file in the legacy text format. The file is
+ * parsed in place, one line at a time.
+ **/
+static gboolean
+up_history_array_from_file (UpHistorySeries *list, const gchar *filename, gint64 since)
+{
+	GMappedFile *mapped;
+	GError *error = NULL;
+	const gchar *data;
+	const gchar *end;
+	guint invalid = 0;
+	guint skipped = 0;
+
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to get data: %s", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+	data = g_mapped_file_get_contents (mapped);
+	end = data + g_mapped_file_get_length (mapped);
+
+	/* a line without a line ending is the result of an interrupted write */
+	while (data < end) {
+		const gchar *eol = memchr (data, '\n', end - data);
+		guint32 time_s;
+		gdouble value;
+		UpDeviceState state;
+
+		if (eol == NULL)
+			break;
+		if (!up_history_parse_line (data, eol - data, &time_s, &value, &state))
+			invalid++;
+		else if (time_s < since)
+			skipped++;
+		else
+			up_history_series_append (list, time_s, value, state);
+		data = eol + 1;
+	}
+
+	g_debug ("loaded %u items of data from %s, skipped %u expired and %u invalid",
+		 list->len, filename, skipped, invalid);
+	g_mapped_file_unref (mapped);
+	return TRUE;
+}
+
+/* A copy of everything a save writes, so that the encoding and the I/O can
+ * happen away from the main context */
+typedef struct {
+	gchar			*filename;
+	gboolean		 full;
+	/* what is new, or all the data for a full write */
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	GByteArray		*rollups[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistorySeries		 transitions;
+	gboolean		 has_profile;
+	UpHistoryProfile	 profile;
+	gboolean		 has_voltage;
+	UpHistoryVoltage	 voltage;
+	/* the journal rotation this save covers */
+	guint			 journal_seq;
+} UpHistorySaveJob;
+
+/**
+ * up_history_save_job_free:
+ **/
+static void
+up_history_save_job_free (UpHistorySaveJob *job)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		up_history_series_clear (&job->series[i]);
+		g_byte_array_unref (job->rollups[i]);
+	}
+	up_history_series_clear (&job->transitions);
+	g_free (job->filename);
+	g_free (job);
+}
+
+/**
+ * up_history_save_job_new:
+ * @final: %TRUE when the history is going away, so old entries are
+ *         removed now and the charge profile and voltage table are saved
+ *
+ * Takes a snapshot of what has to be saved. This must only be called when
+ * no other write is in flight, as the data is marked as saved right away.
+ * The file is only rewritten when old entries have to be removed, at most
+ * once a day.
+ **/
+static UpHistorySaveJob *
+up_history_save_job_new (UpHistory *history, gboolean final)
+{
+	UpHistoryPrivate *priv = history->priv;
+	UpHistorySaveJob *job;
+	gboolean compact;
+	gint64 time_now;
+	guint i;
+
+	/* culling old entries needs a full rewrite, so only do it rarely */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	compact = final || time_now - priv->last_compact > UP_HISTORY_COMPACT_INTERVAL;
+	if (compact) {
+		compact = priv->file_stale;
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+			compact |= up_history_array_needs_compact (history, &priv->series[i]);
+		compact |= up_history_array_needs_compact (history, &priv->transitions);
+	}
+	if (compact) {
+		g_debug ("compacting history");
+		priv->last_compact = time_now;
+		priv->file_stale = FALSE;
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			guint tier;
+
+			priv->generation[i]++;
+			up_history_array_cull (history, &priv->series[i]);
+			for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++)
+				up_history_rollup_remove_before (&priv->rollup[i][tier],
+								 time_now - priv->max_data_age);
+		}
+		up_history_array_cull (history, &priv->transitions);
+
+		/* the charge profile is kept as it is, as the samples left
+		 * may have been downsampled, only the per day sums older
+		 * than the rollups are dropped */
+		up_history_profile_slabs_remove_before (priv->profile_slabs,
+							time_now - priv->max_data_age);
+		up_history_count_samples (history);
+	}
+
+	g_debug ("%s history uses %u samples in %" G_GSIZE_FORMAT " bytes, "
+		 "all histories use %u samples",
+		 priv->id, priv->samples, up_history_get_memory_size (history),
+		 up_history_total_samples);
+
+	job = g_new0 (UpHistorySaveJob, 1);
+	job->filename = up_history_get_filename (history);
+	job->full = compact || priv->file_invalid || !g_file_test (job->filename, G_FILE_TEST_EXISTS);
+
+	/* the rollups only have a few new buckets, so encode them now */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		guint tier;
+
+		up_history_series_copy (&job->series[i], &priv->series[i],
+					job->full ? 0 : priv->series[i].saved);
+		priv->series[i].saved = priv->series[i].len;
+
+		job->rollups[i] = g_byte_array_new ();
+		for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++) {
+			UpHistoryRollup *rollup = &priv->rollup[i][tier];
+
+			if (job->full)
+				rollup->saved = 0;
+			up_history_write_rollup (job->rollups[i], rollup, tier);
+
+			/* the last bucket may still change */
+			rollup->saved = MAX (rollup->len, 1) - 1;
+		}
+	}
+	up_history_series_copy (&job->transitions, &priv->transitions,
+				job->full ? 0 : priv->transitions.saved);
+	priv->transitions.saved = priv->transitions.len;
+
+	if (job->full || final) {
+		job->has_profile = TRUE;
+		job->profile = priv->profile;
+		priv->profile.dirty = FALSE;
+	}
+
+	/* the voltage table is not kept as samples, so append a copy once a
+	 * mean moved noticeably, the last one wins when loading */
+	if (job->full || final || priv->voltage.dirty) {
+		job->has_voltage = TRUE;
+		job->voltage = priv->voltage;
+		up_history_voltage_mark_saved (&priv->voltage);
+	}
+
+	/* samples added from now on go into a journal of their own */
+	if (priv->journal_fd >= 0) {
+		GError *error = NULL;
+		gchar *old_filename;
+
+		old_filename = up_history_get_journal_filename (history, "journal.old");
+		if (!up_history_journal_rotate (priv->journal_fd, old_filename, &error)) {
+			g_warning ("failed to rotate journal: %s", error->message);
+			g_error_free (error);
+		}
+		g_free (old_filename);
+	}
+	job->journal_seq = ++priv->journal_seq;
+	return job;
+}
+
+/**
+ * up_history_save_job_done:
+ *
+ * Called in the main context when the snapshot is on disk.
+ **/
+static void
+up_history_save_job_done (UpHistory *history, UpHistorySaveJob *job)
+{
+	gchar *old_filename;
+
+	/* a later save has added to the old journal */
+	if (job->journal_seq != history->priv->journal_seq)
+		return;
+	old_filename = up_history_get_journal_filename (history, "journal.old");
+	g_unlink (old_filename);
+	g_free (old_filename);
+}
+
+/**
+ * up_history_save_job_run:
+ *
+ * Encodes the snapshot and writes it to disk. This is called from a worker
+ * thread, so only the file state of the history may be used, with the lock
+ * held.
+ **/
+static gboolean
+up_history_save_job_run (UpHistory *history, UpHistorySaveJob *job, GError **error)
+{
+	UpHistoryPrivate *priv = history->priv;
+	gboolean ret = TRUE;
+	GByteArray *chunks;
+	GByteArray *contents = NULL;
+	gsize file_length;
+	gsize offset;
+	guint i;
+
+	chunks = g_byte_array_new ();
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		offset = up_history_file_begin_chunk (chunks, UP_HISTORY_SECTION_PACKED, i);
+		up_history_codec_encode (chunks, &job->series[i], 0);
+		up_history_file_end_chunk (chunks, offset);
+
+		offset = up_history_file_begin_chunk (chunks, UP_HISTORY_SECTION_ROLLUP, i);
+		g_byte_array_append (chunks, job->rollups[i]->data, job->rollups[i]->len);
+		up_history_file_end_chunk (chunks, offset);
+	}
+	if (job->transitions.len > 0) {
+		offset = up_history_file_begin_chunk (chunks, UP_HISTORY_SECTION_TRANSITIONS, 0);
+		up_history_codec_encode (chunks, &job->transitions, 0);
+		up_history_file_end_chunk (chunks, offset);
+	}
+	if (job->has_profile) {
+		offset = up_history_file_begin_chunk (chunks, UP_HISTORY_SECTION_PROFILE, 0);
+		up_history_write_profile (chunks, &job->profile);
+		up_history_file_end_chunk (chunks, offset);
+	}
+	if (job->has_voltage) {
+		offset = up_history_file_begin_chunk (chunks, UP_HISTORY_SECTION_VOLTAGE, 0);
+		up_history_write_voltage (chunks, &job->voltage);
+		up_history_file_end_chunk (chunks, offset);
+	}
+
+	/* only one write is in flight, so the length cannot change under us */
+	g_mutex_lock (&priv->file_lock);
+	file_length = priv->file_length;
+	g_mutex_unlock (&priv->file_lock);
+
+	/* save to disk */
+	if (job->full) {
+		contents = up_history_file_pack (chunks);
+		ret = g_file_set_contents (job->filename, (const gchar *) contents->data, contents->len, error);
+		if (ret)
+			file_length = contents->len;
+	} else if (chunks->len > 0) {
+		ret = up_history_file_append (job->filename, file_length, chunks, error);
+		if (ret)
+			file_length += chunks->len;
+	}
+
+	/* the data is already marked as saved, so rewrite it all next time */
+	g_mutex_lock (&priv->file_lock);
+	priv->file_length = file_length;
+	if (job->full || !ret)
+		priv->file_invalid = !ret;
+	priv->file_writing = FALSE;
+	g_cond_broadcast (&priv->file_cond);
+	g_mutex_unlock (&priv->file_lock);
+
+	if (contents != NULL)
+		g_byte_array_unref (contents);
+	g_byte_array_unref (chunks);
+	return ret;
+}
+
+/**
+ * up_history_save_data_full:
+ * @final: %TRUE when the history is going away
+ *
+ * Saves the data synchronously, after any write that is in flight.
+ **/
+static gboolean
+up_history_save_data_full (UpHistory *history, gboolean final)
+{
+	UpHistoryPrivate *priv = history->priv;
+	UpHistorySaveJob *job;
+	GError *error = NULL;
+	gboolean ret;
+
+	/* we have an ID? */
+	if (priv->id == NULL) {
+		g_warning ("no ID, cannot save");
+		return FALSE;
+	}
+
+	g_mutex_lock (&priv->file_lock);
+	while (priv->file_writing)
+		g_cond_wait (&priv->file_cond, &priv->file_lock);
+	g_mutex_unlock (&priv->file_lock);
+
+	job = up_history_save_job_new (history, final);
+	ret = up_history_save_job_run (history, job, &error);
+	if (ret) {
+		up_history_save_job_done (history, job);
+	} else {
+		g_warning ("failed to save history: %s", error->message);
+		g_error_free (error);
+	}
+	up_history_save_job_free (job);
+	return ret;
+}
+
+/**
+ * up_history_save_data:
+ **/
+gboolean
+up_history_save_data (UpHistory *history)
+{
+	return up_history_save_data_full (history, FALSE);
+}
+
+/**
+ * up_history_save_thread_cb:
+ **/
+static void
+up_history_save_thread_cb (GTask *task,
+			   gpointer source_object,
+			   gpointer task_data,
+			   GCancellable *cancellable)
+{
+	GError *error = NULL;
+
+	if (up_history_save_job_run (UP_HISTORY (source_object), task_data, &error))
+		g_task_return_boolean (task, TRUE);
+	else
+		g_task_return_error (task, error);
+}
+
+static void up_history_save_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+/**
+ * up_history_save_start:
+ *
+ * Starts a write for all the callers waiting in @save_waiters.
+ **/
+static void
+up_history_save_start (UpHistory *history)
 {
-	g_free (history->priv->dir);
-	history->priv->dir = g_strdup (dir);
-	g_mkdir_with_parents (dir, 0755);
+	UpHistoryPrivate *priv = history->priv;
+	UpHistorySaveJob *job;
+
+	job = up_history_save_job_new (history, FALSE);
+	g_mutex_lock (&priv->file_lock);
+	priv->file_writing = TRUE;
+	g_mutex_unlock (&priv->file_lock);
+
+	priv->save_task = g_task_new (history, NULL, up_history_save_done_cb, NULL);
+	g_task_set_source_tag (priv->save_task, up_history_save_start);
+	g_task_set_task_data (priv->save_task, job, (GDestroyNotify) up_history_save_job_free);
+	g_task_run_in_thread (priv->save_task, up_history_save_thread_cb);
 }
 
 /**
- * up_history_array_to_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_save_done_cb:
  *
- * Saves a copy of the list to a file
+ * Called in the main context when a write has finished.
  **/
-static gboolean
-up_history_array_to_file (UpHistory *history, GPtrArray *list, const gchar *filename)
+static void
+up_history_save_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-	guint i;
-	UpHistoryItem *item;
-	gchar *part;
-	GString *string;
-	gboolean ret = TRUE;
+	UpHistory *history = UP_HISTORY (source_object);
+	UpHistoryPrivate *priv = history->priv;
+	GPtrArray *waiters;
 	GError *error = NULL;
-	GTimeVal time_now;
-	guint time_item;
-	guint cull_count = 0;
-
-	/* get current time */
-	g_get_current_time (&time_now);
-
-	/* generate data */
-	string = g_string_new ("");
-	for (i=0; i<list->len; i++) {
-		item = g_ptr_array_index (list, i);
+	gboolean ret;
+	guint i;
 
-		/* only save entries for the last 24 hours */
-		time_item = up_history_item_get_time (item);
-		if (time_now.tv_sec - time_item > history->priv->max_data_age) {
-			cull_count++;
-			continue;
-		}
-		part = up_history_item_to_string (item);
-		if (part == NULL) {
-			ret = FALSE;
-			break;
-		}
-		g_string_append_printf (string, "%s\n", part);
-		g_free (part);
-	}
-	part = g_string_free (string, FALSE);
+	ret = g_task_propagate_boolean (G_TASK (res), &error);
+	if (ret)
+		up_history_save_job_done (history, g_task_get_task_data (G_TASK (res)));
+	g_clear_object (&priv->save_task);
 
-	/* how many did we kill? */
-	g_debug ("culled %i of %i", cull_count, list->len);
+	waiters = priv->save_waiters;
+	priv->save_waiters = priv->save_queue;
+	priv->save_queue = g_ptr_array_new_with_free_func (g_object_unref);
+	for (i = 0; i < waiters->len; i++) {
+		GTask *task = g_ptr_array_index (waiters, i);
 
-	/* we failed to convert to string */
-	if (!ret) {
-		g_warning ("failed to convert");
-		goto out;
+		if (ret)
+			g_task_return_boolean (task, TRUE);
+		else
+			g_task_return_error (task, g_error_copy (error));
 	}
+	g_ptr_array_unref (waiters);
 
-	/* save to disk */
-	ret = g_file_set_contents (filename, part, -1, &error);
+	/* the whole file is written again next time */
 	if (!ret) {
-		g_warning ("failed to set data: %s", error->message);
+		g_warning ("failed to save history: %s", error->message);
 		g_error_free (error);
-		goto out;
+		up_history_schedule_save (history);
 	}
-	g_debug ("saved %s", filename);
 
-out:
-	g_free (part);
-	return ret;
+	/* requested while we were writing */
+	if (priv->save_waiters->len > 0)
+		up_history_save_start (history);
 }
 
 /**
- * up_history_array_from_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_save_data_async:
  *
- * Appends the list from a file
+ * Saves the new data from a worker thread. At most one write is in flight
+ * at a time, and a save requested meanwhile is done when it has finished.
  **/
-static gboolean
-up_history_array_from_file (GPtrArray *list, const gchar *filename)
+void
+up_history_save_data_async (UpHistory *history,
+			    GCancellable *cancellable,
+			    GAsyncReadyCallback callback,
+			    gpointer user_data)
 {
-	gboolean ret;
-	GError *error = NULL;
-	gchar *data = NULL;
-	gchar **parts = NULL;
-	guint i;
-	guint length;
-	UpHistoryItem *item;
+	UpHistoryPrivate *priv;
+	GTask *task;
 
-	/* do we exist */
-	ret = g_file_test (filename, G_FILE_TEST_EXISTS);
-	if (!ret) {
-		g_debug ("failed to get data from %s as file does not exist", filename);
-		goto out;
-	}
+	g_return_if_fail (UP_IS_HISTORY (history));
 
-	/* get contents */
-	ret = g_file_get_contents (filename, &data, NULL, &error);
-	if (!ret) {
-		g_warning ("failed to get data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
+	priv = history->priv;
+	task = g_task_new (history, cancellable, callback, user_data);
+	g_task_set_source_tag (task, up_history_save_data_async);
 
-	/* split by line ending */
-	parts = g_strsplit (data, "\n", 0);
-	length = g_strv_length (parts);
-	if (length == 0) {
-		g_debug ("no data in %s", filename);
-		goto out;
+	/* we have an ID? */
+	if (priv->id == NULL) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+					 "no ID, cannot save");
+		g_object_unref (task);
+		return;
 	}
 
-	/* add valid entries */
-	g_debug ("loading %i items of data from %s", length, filename);
-	for (i=0; i<length-1; i++) {
-		item = up_history_item_new ();
-		ret = up_history_item_set_from_string (item, parts[i]);
-		if (ret)
-			g_ptr_array_add (list, item);
-		else
-			g_object_unref (item);
+	if (priv->save_task != NULL) {
+		g_ptr_array_add (priv->save_queue, task);
+		return;
 	}
-
-out:
-	g_strfreev (parts);
-	g_free (data);
-	return ret;
+	g_ptr_array_add (priv->save_waiters, task);
+	up_history_save_start (history);
 }
 
 /**
- * up_history_save_data:
+ * up_history_save_data_finish:
  **/
 gboolean
-up_history_save_data (UpHistory *history)
+up_history_save_data_finish (UpHistory *history, GAsyncResult *res, GError **error)
 {
-	gboolean ret = FALSE;
-	gchar *filename_rate = NULL;
-	gchar *filename_charge = NULL;
-	gchar *filename_time_full = NULL;
-	gchar *filename_time_empty = NULL;
-
-	/* we have an ID? */
-	if (history->priv->id == NULL) {
-		g_warning ("no ID, cannot save");
-		goto out;
-	}
-
-	/* get filenames */
-	filename_rate = up_history_get_filename (history, "rate");
-	filename_charge = up_history_get_filename (history, "charge");
-	filename_time_full = up_history_get_filename (history, "time-full");
-	filename_time_empty = up_history_get_filename (history, "time-empty");
-
-	/* save to disk */
-	ret = up_history_array_to_file (history, history->priv->data_rate, filename_rate);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_charge, filename_charge);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_full, filename_time_full);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_empty, filename_time_empty);
-	if (!ret)
-		goto out;
-out:
-	g_free (filename_rate);
-	g_free (filename_charge);
-	g_free (filename_time_full);
-	g_free (filename_time_empty);
-	return ret;
-}
+	g_return_val_if_fail (g_task_is_valid (res, history), FALSE);
 
-/**
- * up_history_schedule_save_cb:
- **/
-static gboolean
-up_history_schedule_save_cb (UpHistory *history)
-{
-	up_history_save_data (history);
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
-	return FALSE;
+	return g_task_propagate_boolean (G_TASK (res), error);
 }
 
 /**
@@ -601,24 +2377,23 @@ static gboolean
 up_history_is_low_power (UpHistory *history)
 {
 	guint length;
-	UpHistoryItem *item;
+	const UpHistorySeries *array = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
 
 	/* current status is always up to date */
 	if (history->priv->state != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* have we got any data? */
-	length = history->priv->data_charge->len;
+	length = array->len;
 	if (length == 0)
 		return FALSE;
 
 	/* get the last saved charge object */
-	item = (UpHistoryItem *) g_ptr_array_index (history->priv->data_charge, length-1);
-	if (up_history_item_get_state (item) != UP_DEVICE_STATE_DISCHARGING)
+	if (up_history_series_get_state (array, length-1) != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* high enough */
-	if (up_history_item_get_value (item) > UP_HISTORY_LOW_POWER_PERCENT)
+	if (up_history_series_get_value (array, length-1) > UP_HISTORY_LOW_POWER_PERCENT)
 		return FALSE;
 
 	/* we are low power */
@@ -634,6 +2409,13 @@ up_history_schedule_save (UpHistory *history)
 	gboolean ret;
 	gint timeout = UP_HISTORY_SAVE_INTERVAL;
 
+	/* the journal keeps the samples, so the disk can be left alone */
+	if (history->priv->journal_fd >= 0) {
+		up_history_writer_schedule (history->priv->writer, history,
+					    UP_HISTORY_JOURNAL_SAVE_INTERVAL);
+		return TRUE;
+	}
+
 	/* if low power, then don't batch up save requests */
 	ret = up_history_is_low_power (history);
 	if (ret) {
@@ -641,68 +2423,344 @@ up_history_schedule_save (UpHistory *history)
 		timeout = UP_HISTORY_SAVE_INTERVAL_LOW_POWER;
 	}
 
-	/* we already have one saved, clear it if it will fire earlier */
-	if (history->priv->save_source) {
-		guint64 ready = g_source_get_ready_time (history->priv->save_source);
+	/* saved together with the other histories */
+	up_history_writer_schedule (history->priv->writer, history, timeout);
+	return TRUE;
+}
 
-		if (ready > g_source_get_time (history->priv->save_source) + timeout * G_USEC_PER_SEC) {
-			g_clear_pointer (&history->priv->save_source, g_source_destroy);
-		} else {
-			g_debug ("deferring as earlier timeout is already queued");
-			return TRUE;
+/**
+ * up_history_transitions_add:
+ *
+ * Records a charge sample in the transition index if the state changed.
+ * The marker saved when loading has no state, so it is not a transition.
+ **/
+static void
+up_history_transitions_add (UpHistory *history, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistorySeries *transitions = &history->priv->transitions;
+
+	if (state == UP_DEVICE_STATE_UNKNOWN)
+		return;
+	if (transitions->len > 0 &&
+	    up_history_series_get_state (transitions, transitions->len - 1) == state)
+		return;
+	up_history_series_append (transitions, time_s, value, state);
+}
+
+/**
+ * up_history_transitions_catch_up:
+ *
+ * Adds the transitions of the charge samples that are newer than the
+ * stored index, or rebuilds it for files written by older versions.
+ **/
+static void
+up_history_transitions_catch_up (UpHistory *history)
+{
+	const UpHistorySeries *series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	const UpHistorySeries *transitions = &history->priv->transitions;
+	gint64 since = 0;
+	guint i;
+
+	if (transitions->len > 0)
+		since = (gint64) up_history_series_get_time (transitions, transitions->len - 1) + 1;
+	for (i = up_history_series_find_time (series, since); i < series->len; i++)
+		up_history_transitions_add (history,
+					    up_history_series_get_time (series, i),
+					    up_history_series_get_value (series, i),
+					    up_history_series_get_state (series, i));
+}
+
+/**
+ * up_history_append:
+ *
+ * Adds a sample to a series and its rollups.
+ **/
+static void
+up_history_append (UpHistory *history, UpHistoryType type, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	guint tier;
+
+	up_history_series_append (&history->priv->series[type], time_s, value, state);
+	history->priv->generation[type]++;
+	if (history->priv->journal_fd >= 0) {
+		GError *error = NULL;
+
+		/* fall back to saving to disk more often */
+		if (!up_history_journal_append (history->priv->journal_fd, type,
+						time_s, value, state, &error)) {
+			g_warning ("disabling journal: %s", error->message);
+			g_error_free (error);
+			close (history->priv->journal_fd);
+			history->priv->journal_fd = -1;
 		}
 	}
+	for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++)
+		up_history_rollup_add (&history->priv->rollup[type][tier], time_s, value, state);
+	if (type == UP_HISTORY_TYPE_CHARGE) {
+		up_history_profile_add (&history->priv->profile, history->priv->profile_slabs,
+					time_s, value, state);
+		up_history_transitions_add (history, time_s, value, state);
+	}
+}
+
+/**
+ * up_history_load_chunk:
+ **/
+static void
+up_history_load_chunk (UpHistorySection section,
+		       guint8 sub,
+		       const guint8 *data,
+		       gsize length,
+		       gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (user_data);
+	UpHistoryPrivate *priv = history->priv;
+	guint skipped = 0;
+
+	switch (section) {
+	case UP_HISTORY_SECTION_SERIES:
+		if (sub < UP_HISTORY_TYPE_UNKNOWN)
+			skipped = up_history_read_series (&priv->series[sub], data, length,
+							  priv->load_since);
+		break;
+	case UP_HISTORY_SECTION_PACKED:
+		if (sub < UP_HISTORY_TYPE_UNKNOWN &&
+		    !up_history_codec_decode (&priv->series[sub], data, length,
+					      priv->load_since, &skipped))
+			g_warning ("failed to decode %s history", up_history_type_names[sub]);
+		break;
+	case UP_HISTORY_SECTION_ROLLUP:
+		if (sub < UP_HISTORY_TYPE_UNKNOWN)
+			skipped = up_history_read_rollup (priv->rollup[sub], data, length,
+							  priv->load_since);
+		break;
+	case UP_HISTORY_SECTION_TRANSITIONS:
+		if (!up_history_codec_decode (&priv->transitions, data, length,
+					      priv->load_since, &skipped))
+			g_warning ("failed to decode state transitions");
+		break;
+	case UP_HISTORY_SECTION_PROFILE:
+		/* the last one saved is the most recent */
+		if (!up_history_read_profile (&priv->profile, data, length))
+			up_history_profile_init (&priv->profile);
+		break;
+	case UP_HISTORY_SECTION_VOLTAGE:
+		/* the last one saved is the most recent */
+		if (!up_history_read_voltage (&priv->voltage, data, length))
+			up_history_voltage_init (&priv->voltage);
+		break;
+	default:
+		g_debug ("ignoring unknown history section %u", section);
+		break;
+	}
 
-	/* nothing scheduled */
-	g_debug ("saving in %i seconds", timeout);
-	history->priv->save_source = g_timeout_source_new_seconds (timeout);
-	g_source_set_name (history->priv->save_source, "[upower] up_history_schedule_save_cb");
-	g_source_attach (history->priv->save_source, NULL);
-	g_source_set_callback (history->priv->save_source,
-			       (GSourceFunc) up_history_schedule_save_cb, history,
-			       NULL);
+	/* removed from the file on the next compaction */
+	if (skipped > 0)
+		priv->file_stale = TRUE;
+}
+
+/**
+ * up_history_load_file:
+ *
+ * Return value: %TRUE if the file exists, even if it could not be read
+ **/
+static gboolean
+up_history_load_file (UpHistory *history, const gchar *filename)
+{
+	GMappedFile *mapped;
+	GError *error = NULL;
+
+	if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+		return FALSE;
+
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to get data: %s", error->message);
+		g_error_free (error);
+		history->priv->file_invalid = TRUE;
+		return TRUE;
+	}
+	if (!up_history_file_parse ((const guint8 *) g_mapped_file_get_contents (mapped),
+				    g_mapped_file_get_length (mapped),
+				    up_history_load_chunk, history,
+				    &history->priv->file_length, &error)) {
+		/* replaced on the next save */
+		g_warning ("failed to load %s: %s", filename, error->message);
+		g_error_free (error);
+		history->priv->file_invalid = TRUE;
+	}
+	g_mapped_file_unref (mapped);
 	return TRUE;
 }
 
 /**
- * up_history_load_data:
+ * up_history_import_series:
+ *
+ * Loads a series written by an older version, either in the per-series
+ * binary format or in the text format.
+ *
+ * Return value: %TRUE if there was a file to import
  **/
 static gboolean
-up_history_load_data (UpHistory *history)
+up_history_import_series (UpHistory *history, UpHistorySeries *list, const gchar *type)
 {
 	gchar *filename;
-	UpHistoryItem *item;
+	gboolean ret = FALSE;
 
-	/* load rate history from disk */
-	filename = up_history_get_filename (history, "rate");
-	up_history_array_from_file (history->priv->data_rate, filename);
+	filename = up_history_get_old_filename (history, type, "bin");
+	if (g_file_test (filename, G_FILE_TEST_EXISTS)) {
+		up_history_array_from_binary_file (list, filename, history->priv->load_since);
+		ret = TRUE;
+		goto out;
+	}
 	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "charge");
-	up_history_array_from_file (history->priv->data_charge, filename);
+	filename = up_history_get_old_filename (history, type, "dat");
+	if (g_file_test (filename, G_FILE_TEST_EXISTS)) {
+		up_history_array_from_file (list, filename, history->priv->load_since);
+		ret = TRUE;
+	}
+out:
 	g_free (filename);
+	return ret;
+}
+
+/**
+ * up_history_remove_old_files:
+ **/
+static void
+up_history_remove_old_files (UpHistory *history)
+{
+	const gchar *suffixes[] = { "bin", "dat", "rollup" };
+	gchar *filename;
+	guint i, j;
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-full");
-	up_history_array_from_file (history->priv->data_time_full, filename);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		for (j = 0; j < G_N_ELEMENTS (suffixes); j++) {
+			filename = up_history_get_old_filename (history, up_history_type_names[i], suffixes[j]);
+			g_unlink (filename);
+			g_free (filename);
+		}
+	}
+	filename = up_history_get_old_filename (history, "profile", "bin");
+	g_unlink (filename);
 	g_free (filename);
+}
+
+/**
+ * up_history_replay_cb:
+ **/
+static void
+up_history_replay_cb (guint8 type, guint32 time_s, gdouble value, UpDeviceState state, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (user_data);
+	UpHistorySeries *series;
+	guint last;
+
+	if (type >= UP_HISTORY_TYPE_UNKNOWN)
+		return;
+
+	/* too old to be loaded, like the samples in the file */
+	if ((gint64) time_s < history->priv->load_since)
+		return;
+
+	/* the old journal may have been saved already */
+	series = &history->priv->series[type];
+	if (series->len > 0) {
+		last = series->len - 1;
+		if (time_s < up_history_series_get_time (series, last))
+			return;
+		if (time_s == up_history_series_get_time (series, last) &&
+		    value == up_history_series_get_value (series, last) &&
+		    state == up_history_series_get_state (series, last))
+			return;
+	}
+	up_history_series_append (series, time_s, value, state);
+}
+
+/**
+ * up_history_load_journal:
+ *
+ * Adds the samples that were not saved to the file before the daemon
+ * stopped, and opens the journal for the new ones.
+ **/
+static void
+up_history_load_journal (UpHistory *history)
+{
+	const gchar *suffixes[] = { "journal.old", "journal" };
+	GError *error = NULL;
+	gchar *filename;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+		filename = up_history_get_journal_filename (history, suffixes[i]);
+		if (!up_history_journal_replay (filename, up_history_replay_cb, history, &error)) {
+			g_warning ("failed to replay %s: %s", filename, error->message);
+			g_clear_error (&error);
+		}
+		g_free (filename);
+	}
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-empty");
-	up_history_array_from_file (history->priv->data_time_empty, filename);
+	filename = up_history_get_journal_filename (history, "journal");
+	history->priv->journal_fd = up_history_journal_open (filename, &error);
+	if (history->priv->journal_fd < 0) {
+		g_debug ("not using a journal: %s", error->message);
+		g_error_free (error);
+	}
 	g_free (filename);
+}
+
+/**
+ * up_history_load_data:
+ **/
+static gboolean
+up_history_load_data (UpHistory *history)
+{
+	gboolean imported = FALSE;
+	gchar *filename;
+	guint32 time_now;
+	guint i;
+
+	/* entries that would be removed on the next save are not loaded */
+	history->priv->load_since = g_get_real_time () / G_USEC_PER_SEC - history->priv->max_data_age;
+
+	/* everything is in one file, or in a file per series for older versions */
+	filename = up_history_get_filename (history);
+	if (!up_history_load_file (history, filename)) {
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+			imported |= up_history_import_series (history, &history->priv->series[i],
+							      up_history_type_names[i]);
+	}
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		history->priv->series[i].saved = history->priv->series[i].len;
+	history->priv->transitions.saved = history->priv->transitions.len;
+	up_history_load_journal (history);
+
+	/* recreate what was not saved yet */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		up_history_rollup_catch_up (history, i);
+	up_history_transitions_catch_up (history);
+	if (history->priv->profile.covered == 0)
+		up_history_profile_rebuild (history);
+	else
+		up_history_profile_catch_up (history);
+
+	/* one-time import of the old files */
+	if (imported) {
+		if (up_history_save_data_full (history, FALSE)) {
+			g_debug ("imported history into %s", filename);
+			up_history_remove_old_files (history);
+		}
+	}
 
 	/* save a marker so we don't use incomplete percentages */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	g_ptr_array_add (history->priv->data_rate, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_charge, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_full, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_empty, g_object_ref (item));
-	g_object_unref (item);
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		up_history_append (history, i, time_now, 0.0, UP_DEVICE_STATE_UNKNOWN);
+	up_history_enforce_limits (history);
 	up_history_schedule_save (history);
 
+	g_free (filename);
 	return TRUE;
 }
 
@@ -742,14 +2800,56 @@ up_history_set_state (UpHistory *history, UpDeviceState state)
 	return TRUE;
 }
 
+/**
+ * up_history_add_data:
+ **/
+static void
+up_history_add_data (UpHistory *history, UpHistoryType type, gdouble value)
+{
+	up_history_append (history, type, g_get_real_time () / G_USEC_PER_SEC,
+			   value, history->priv->state);
+	up_history_enforce_limits (history);
+	up_history_schedule_save (history);
+}
+
+/**
+ * up_history_is_significant:
+ *
+ * Return value: %TRUE if the value is different enough from the last
+ *               recorded sample, or if that is too old
+ **/
+static gboolean
+up_history_is_significant (UpHistory *history, UpHistoryType type, gdouble value)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	gdouble last_value;
+	gdouble tolerance;
+	gint64 time_now;
+	guint last;
+
+	if (series->len == 0)
+		return TRUE;
+	last = series->len - 1;
+	if (up_history_series_get_state (series, last) != history->priv->state)
+		return TRUE;
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	if (history->priv->max_silence > 0 &&
+	    time_now - up_history_series_get_time (series, last) >= history->priv->max_silence)
+		return TRUE;
+
+	last_value = up_history_series_get_value (series, last);
+	tolerance = MAX (history->priv->tolerance[type],
+			 history->priv->relative_tolerance[type] * fabs (last_value) / 100.0);
+	return fabs (value - last_value) > tolerance;
+}
+
 /**
  * up_history_set_charge_data:
  **/
 gboolean
 up_history_set_charge_data (UpHistory *history, gdouble percentage)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -758,14 +2858,11 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 		return FALSE;
 	if (history->priv->percentage_last == percentage)
 		return FALSE;
+	if (!up_history_is_significant (history, UP_HISTORY_TYPE_CHARGE, percentage))
+		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, percentage);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_charge, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_CHARGE, percentage);
 
 	/* save last value */
 	history->priv->percentage_last = percentage;
@@ -773,14 +2870,54 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 	return TRUE;
 }
 
+/**
+ * up_history_set_voltage_data:
+ * @percentage: the state of charge
+ * @temperature: the battery temperature in °C, or 0 if unknown
+ * @voltage: the voltage reading in V
+ *
+ * Learns the voltage of the battery at a state of charge, see
+ * up_history_get_voltage(). This is kept as a table, not as samples.
+ **/
+gboolean
+up_history_set_voltage_data (UpHistory *history, gdouble percentage, gdouble temperature, gdouble voltage)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	if (history->priv->id == NULL)
+		return FALSE;
+	if (voltage < 0.01)
+		return FALSE;
+	up_history_voltage_add (&history->priv->voltage, percentage, temperature, voltage);
+	return TRUE;
+}
+
+/**
+ * up_history_get_voltage:
+ * @from: the lower state of charge
+ * @to: the upper state of charge
+ * @temperature: the battery temperature in °C, or 0 if unknown
+ * @fallback: the voltage to use where nothing was learned yet
+ *
+ * Return value: the mean voltage between two states of charge in V, or
+ *               the voltage at one state of charge if they are the same
+ **/
+gdouble
+up_history_get_voltage (UpHistory *history, gdouble from, gdouble to, gdouble temperature, gdouble fallback)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), fallback);
+
+	if (history->priv->id == NULL)
+		return fallback;
+	return up_history_voltage_get_mean (&history->priv->voltage, from, to, temperature, fallback);
+}
+
 /**
  * up_history_set_rate_data:
  **/
 gboolean
 up_history_set_rate_data (UpHistory *history, gdouble rate)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -789,14 +2926,11 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 		return FALSE;
 	if (history->priv->rate_last == rate)
 		return FALSE;
+	if (!up_history_is_significant (history, UP_HISTORY_TYPE_RATE, rate))
+		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, rate);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_rate, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_RATE, rate);
 
 	/* save last value */
 	history->priv->rate_last = rate;
@@ -810,8 +2944,6 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 gboolean
 up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -822,14 +2954,11 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 	if (history->priv->time_full_last == time_s)
 		return FALSE;
+	if (!up_history_is_significant (history, UP_HISTORY_TYPE_TIME_FULL, (gdouble) time_s))
+		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_full, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_TIME_FULL, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_full_last = time_s;
@@ -843,8 +2972,6 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 gboolean
 up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -855,14 +2982,11 @@ up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 	if (history->priv->time_empty_last == time_s)
 		return FALSE;
+	if (!up_history_is_significant (history, UP_HISTORY_TYPE_TIME_EMPTY, (gdouble) time_s))
+		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_empty, item);
-	up_history_schedule_save (history);
+	up_history_add_data (history, UP_HISTORY_TYPE_TIME_EMPTY, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_empty_last = time_s;
@@ -888,17 +3012,60 @@ up_history_class_init (UpHistoryClass *klass)
 static void
 up_history_init (UpHistory *history)
 {
+	UpConfig *config;
+	guint i;
+
 	history->priv = up_history_get_instance_private (history);
-	history->priv->data_rate = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_charge = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_full = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_empty = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	up_history_profile_init (&history->priv->profile);
+	history->priv->profile_slabs = up_history_profile_slabs_new ();
+	up_history_voltage_init (&history->priv->voltage);
+	up_history_series_init (&history->priv->transitions);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		guint tier;
+
+		up_history_series_init (&history->priv->series[i]);
+		for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++)
+			up_history_rollup_init (&history->priv->rollup[i][tier],
+						up_history_rollup_widths[tier]);
+	}
 	history->priv->max_data_age = UP_HISTORY_DEFAULT_MAX_DATA_AGE;
+	history->priv->writer = up_history_writer_new ();
+	history->priv->journal_fd = -1;
+
+	config = up_config_new ();
+	history->priv->max_series_samples = up_config_get_uint (config, "HistoryMaxSamplesPerSeries");
+	if (history->priv->max_series_samples == 0)
+		history->priv->max_series_samples = UP_HISTORY_DEFAULT_MAX_SERIES_SAMPLES;
+	history->priv->max_device_samples = up_config_get_uint (config, "HistoryMaxSamplesPerDevice");
+	if (history->priv->max_device_samples == 0)
+		history->priv->max_device_samples = UP_HISTORY_DEFAULT_MAX_DEVICE_SAMPLES;
+	history->priv->tolerance[UP_HISTORY_TYPE_CHARGE] = up_config_get_double (config, "HistoryChargeTolerance");
+	history->priv->tolerance[UP_HISTORY_TYPE_RATE] = up_config_get_double (config, "HistoryRateTolerance");
+	history->priv->relative_tolerance[UP_HISTORY_TYPE_RATE] = up_config_get_double (config, "HistoryRateRelativeTolerance");
+	for (i = UP_HISTORY_TYPE_TIME_FULL; i <= UP_HISTORY_TYPE_TIME_EMPTY; i++) {
+		history->priv->tolerance[i] = up_config_get_double (config, "HistoryTimeTolerance");
+		history->priv->relative_tolerance[i] = up_config_get_double (config, "HistoryTimeRelativeTolerance");
+	}
+	history->priv->max_silence = up_config_get_uint (config, "HistoryMaxSilence");
+	history->priv->max_total_samples = up_config_get_uint (config, "HistoryMaxSamples");
+	if (history->priv->max_total_samples == 0)
+		history->priv->max_total_samples = UP_HISTORY_DEFAULT_MAX_TOTAL_SAMPLES;
+	g_object_unref (config);
+	up_history_count++;
+
+	g_mutex_init (&history->priv->file_lock);
+	g_cond_init (&history->priv->file_cond);
+	history->priv->save_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+	history->priv->save_queue = g_ptr_array_new_with_free_func (g_object_unref);
 
 	if (g_getenv ("UPOWER_HISTORY_DIR"))
 		up_history_set_directory (history, g_getenv ("UPOWER_HISTORY_DIR"));
 	else
 		up_history_set_directory (history, HISTORY_DIR);
+	if (g_getenv ("UPOWER_HISTORY_JOURNAL_DIR"))
+		up_history_set_journal_directory (history, g_getenv ("UPOWER_HISTORY_JOURNAL_DIR"));
+	else
+		up_history_set_journal_directory (history, HISTORY_JOURNAL_DIR);
 }
 
 /**
@@ -909,23 +3076,47 @@ static void
 up_history_finalize (GObject *object)
 {
 	UpHistory *history;
+	guint i;
 
 	g_return_if_fail (UP_IS_HISTORY (object));
 
 	history = UP_HISTORY (object);
 
-	/* save */
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
-	if (history->priv->id != NULL)
-		up_history_save_data (history);
-
-	g_ptr_array_unref (history->priv->data_rate);
-	g_ptr_array_unref (history->priv->data_charge);
-	g_ptr_array_unref (history->priv->data_time_full);
-	g_ptr_array_unref (history->priv->data_time_empty);
+	/* save, a write in flight holds a reference so none is left */
+	up_history_writer_cancel (history->priv->writer, history);
+	g_object_unref (history->priv->writer);
+	if (history->priv->id != NULL &&
+	    up_history_save_data_full (history, TRUE) &&
+	    history->priv->journal_fd >= 0) {
+		gchar *filename;
+
+		/* everything is in the file now */
+		filename = up_history_get_journal_filename (history, "journal");
+		g_unlink (filename);
+		g_free (filename);
+	}
+	if (history->priv->journal_fd >= 0)
+		close (history->priv->journal_fd);
+	g_ptr_array_unref (history->priv->save_waiters);
+	g_ptr_array_unref (history->priv->save_queue);
+	g_mutex_clear (&history->priv->file_lock);
+	g_cond_clear (&history->priv->file_cond);
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		guint tier;
+
+		up_history_series_clear (&history->priv->series[i]);
+		for (tier = 0; tier < UP_HISTORY_ROLLUP_TIERS; tier++)
+			up_history_rollup_clear (&history->priv->rollup[i][tier]);
+	}
+	up_history_series_clear (&history->priv->transitions);
+	g_array_unref (history->priv->profile_slabs);
+	up_history_total_samples -= history->priv->samples;
+	up_history_count--;
 
 	g_free (history->priv->id);
 	g_free (history->priv->dir);
+	g_free (history->priv->journal_dir);
 
 	g_return_if_fail (history->priv != NULL);
 
@@ -23,6 +23,7 @@
 #define __UP_HISTORY_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "up-types.h"
 
@@ -58,6 +59,21 @@ typedef enum {
 	UP_HISTORY_TYPE_UNKNOWN
 } UpHistoryType;
 
+/* the time spent per percentage point, for a range of percentage points */
+typedef struct {
+	guint		 percentage;
+	gdouble		 mean;
+	gdouble		 variance;
+	guint		 count;
+} UpHistoryStatisticsBin;
+
+typedef enum {
+	UP_HISTORY_RESOLUTION_MODE_AVERAGE,
+	UP_HISTORY_RESOLUTION_MODE_LTTB,
+	UP_HISTORY_RESOLUTION_MODE_MINMAX,
+	UP_HISTORY_RESOLUTION_MODE_UNKNOWN
+} UpHistoryResolutionMode;
+
 
 GType		 up_history_get_type			(void);
 UpHistory	*up_history_new				(void);
@@ -66,8 +82,42 @@ GPtrArray	*up_history_get_data			(UpHistory		*history,
 							 UpHistoryType		 type,
 							 guint			 timespan,
 							 guint			 resolution);
+GPtrArray	*up_history_get_data_full		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan,
+							 guint			 resolution,
+							 UpHistoryResolutionMode mode);
+GPtrArray	*up_history_get_data_multi		(UpHistory		*history,
+							 const UpHistoryType	*types,
+							 guint			 n_types,
+							 guint			 timespan,
+							 guint			 resolution);
+UpHistoryResolutionMode up_history_resolution_mode_from_string (const gchar	*mode);
+GPtrArray	*up_history_get_range			(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint32		 start,
+							 guint32		 end,
+							 guint			 max_points,
+							 UpDeviceState		 state,
+							 guint32		*next);
+GPtrArray	*up_history_get_transitions		(UpHistory		*history,
+							 guint32		 start,
+							 guint32		 end);
+GArray		*up_history_get_statistics		(UpHistory		*history,
+							 gboolean		 charging,
+							 guint			 bin_width,
+							 guint			 timespan);
 GPtrArray	*up_history_get_profile_data		(UpHistory		*history,
 							 gboolean		 charging);
+gint64		 up_history_get_profile_time		(UpHistory		*history,
+							 gboolean		 charging,
+							 gdouble		 from,
+							 gdouble		 to);
+guint		 up_history_get_generation		(UpHistory		*history,
+							 UpHistoryType		 type);
+gint64		 up_history_get_data_expiry		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan);
 gboolean	 up_history_set_id			(UpHistory		*history,
 							 const gchar		*id);
 gboolean	 up_history_set_state			(UpHistory		*history,
@@ -80,12 +130,39 @@ gboolean	 up_history_set_time_full_data		(UpHistory		*history,
 							 gint64			 time);
 gboolean	 up_history_set_time_empty_data		(UpHistory		*history,
 							 gint64			 time);
+gboolean	 up_history_set_voltage_data		(UpHistory		*history,
+							 gdouble		 percentage,
+							 gdouble		 temperature,
+							 gdouble		 voltage);
+gdouble		 up_history_get_voltage			(UpHistory		*history,
+							 gdouble		 from,
+							 gdouble		 to,
+							 gdouble		 temperature,
+							 gdouble		 fallback);
 void		 up_history_set_max_data_age		(UpHistory		*history,
 							 guint			 max_data_age);
+void		 up_history_set_tolerance		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 gdouble		 tolerance,
+							 gdouble		 relative_tolerance);
+void		 up_history_set_max_samples		(UpHistory		*history,
+							 guint			 max_series_samples,
+							 guint			 max_device_samples);
+void		 up_history_set_max_total_samples	(UpHistory		*history,
+							 guint			 max_total_samples);
 gboolean	 up_history_save_data			(UpHistory		*history);
+void		 up_history_save_data_async		(UpHistory		*history,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+gboolean	 up_history_save_data_finish		(UpHistory		*history,
+							 GAsyncResult		*res,
+							 GError			**error);
 
 void		 up_history_set_directory		(UpHistory		*history,
 							 const gchar		*dir);
+void		 up_history_set_journal_directory	(UpHistory		*history,
+							 const gchar		*dir);
 
 G_END_DECLS
 
@@ -32,6 +32,12 @@
 #include "up-device.h"
 #include "up-device-list.h"
 #include "up-history.h"
+#include "up-history-rollup.h"
+#include "up-history-profile.h"
+#include "up-history-voltage.h"
+#include "up-history-codec.h"
+#include "up-history-writer.h"
+#include "up-history-journal.h"
 #include "up-native.h"
 
 gchar *history_dir = NULL;
@@ -120,20 +126,215 @@ static void
 up_test_history_remove_temp_files (void)
 {
 	gchar *filename;
-	filename = g_build_filename (history_dir, "history-time-full-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-test.uph", NULL);
 	g_unlink (filename);
 	g_free (filename);
-	filename = g_build_filename (history_dir, "history-time-empty-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-rate-test.dat", NULL);
+	filename = g_build_filename (g_get_tmp_dir (), "history-test.journal", NULL);
 	g_unlink (filename);
 	g_free (filename);
 }
 
+static void
+up_test_history_rollup_func (void)
+{
+	UpHistoryRollup rollup;
+
+	up_history_rollup_init (&rollup, 60);
+
+	/* samples in the same slot and state share a bucket */
+	up_history_rollup_add (&rollup, 120, 50.0f, UP_DEVICE_STATE_DISCHARGING);
+	up_history_rollup_add (&rollup, 150, 48.0f, UP_DEVICE_STATE_DISCHARGING);
+	g_assert_cmpint (rollup.len, ==, 1);
+	g_assert_cmpint (rollup.count[UP_HISTORY_ROLLUP_IDX (&rollup, 0)], ==, 2);
+	g_assert_cmpfloat (rollup.sum[UP_HISTORY_ROLLUP_IDX (&rollup, 0)], ==, 98.0f);
+	g_assert_cmpfloat (rollup.min[UP_HISTORY_ROLLUP_IDX (&rollup, 0)], ==, 48.0f);
+
+	/* a state change starts a new bucket */
+	up_history_rollup_add (&rollup, 160, 48.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (rollup.len, ==, 2);
+
+	/* so does a new slot */
+	up_history_rollup_add (&rollup, 180, 49.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (rollup.len, ==, 3);
+	g_assert_cmpint (up_history_rollup_find_time (&rollup, 155), ==, 1);
+
+	/* buckets are dropped once all their samples are too old */
+	up_history_rollup_remove_before (&rollup, 151);
+	g_assert_cmpint (rollup.len, ==, 2);
+	g_assert_cmpint (rollup.first[UP_HISTORY_ROLLUP_IDX (&rollup, 0)], ==, 160);
+
+	up_history_rollup_clear (&rollup);
+}
+
+static void
+up_test_history_profile_func (void)
+{
+	UpHistoryProfile profile;
+	UpHistoryProfileSlab *slab;
+	GArray *slabs;
+
+	up_history_profile_init (&profile);
+	slabs = up_history_profile_slabs_new ();
+
+	/* the time between two percentage points goes into the newer bin,
+	 * the first point of a run only starts the scan */
+	up_history_profile_add (&profile, slabs, 100, 90.0f, UP_DEVICE_STATE_DISCHARGING);
+	up_history_profile_add (&profile, slabs, 160, 89.0f, UP_DEVICE_STATE_DISCHARGING);
+	up_history_profile_add (&profile, slabs, 200, 88.0f, UP_DEVICE_STATE_DISCHARGING);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_DISCHARGING][89], ==, 0);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_DISCHARGING][88], ==, 1);
+	g_assert_cmpfloat (profile.sum[UP_HISTORY_PROFILE_DISCHARGING][88], ==, 40.0f);
+	g_assert_cmpuint (profile.covered, ==, 200);
+
+	/* the learned time fills in points that were not seen, as long as
+	 * there are not too many of them */
+	g_assert_cmpfloat (up_history_profile_get_time (&profile, UP_HISTORY_PROFILE_DISCHARGING, 87.0f, 88.0f), ==, 40.0f);
+	g_assert_cmpfloat (up_history_profile_get_time (&profile, UP_HISTORY_PROFILE_DISCHARGING, 86.0f, 88.0f), ==, 80.0f);
+	g_assert_cmpfloat (up_history_profile_get_time (&profile, UP_HISTORY_PROFILE_DISCHARGING, 0.0f, 88.0f), <, 0.0f);
+
+	/* a state change restarts the scan */
+	up_history_profile_add (&profile, slabs, 230, 88.0f, UP_DEVICE_STATE_CHARGING);
+	up_history_profile_add (&profile, slabs, 260, 89.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_CHARGING][89], ==, 0);
+
+	/* jumps are ignored */
+	up_history_profile_add (&profile, slabs, 300, 95.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_CHARGING][95], ==, 0);
+	up_history_profile_add (&profile, slabs, 330, 96.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_CHARGING][96], ==, 0);
+	up_history_profile_add (&profile, slabs, 360, 97.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (profile.count[UP_HISTORY_PROFILE_CHARGING][97], ==, 1);
+
+	/* the same sums are kept per day, with the sum of squares */
+	up_history_profile_add (&profile, slabs, UP_HISTORY_PROFILE_SLAB_WIDTH + 60, 98.0f, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpint (slabs->len, ==, 2);
+	slab = &g_array_index (slabs, UpHistoryProfileSlab, 0);
+	g_assert_cmpint (slab->count[UP_HISTORY_PROFILE_DISCHARGING][88], ==, 1);
+	g_assert_cmpfloat (slab->sumsq[UP_HISTORY_PROFILE_DISCHARGING][88], ==, 1600.0f);
+	g_assert_cmpint (slab->count[UP_HISTORY_PROFILE_CHARGING][97], ==, 1);
+	slab = &g_array_index (slabs, UpHistoryProfileSlab, 1);
+	g_assert_cmpuint (slab->start, ==, UP_HISTORY_PROFILE_SLAB_WIDTH);
+	g_assert_cmpint (slab->count[UP_HISTORY_PROFILE_CHARGING][98], ==, 1);
+	up_history_profile_slabs_remove_before (slabs, UP_HISTORY_PROFILE_SLAB_WIDTH);
+	g_assert_cmpint (slabs->len, ==, 1);
+	g_array_unref (slabs);
+}
+
+static void
+up_test_history_voltage_func (void)
+{
+	UpHistoryVoltage voltage;
+
+	up_history_voltage_init (&voltage);
+
+	/* nothing learned yet */
+	g_assert_cmpfloat (up_history_voltage_get_mean (&voltage, 0.0f, 100.0f, 25.0f, 7.4f), ==, 7.4f);
+
+	/* charging and discharging readings average out */
+	up_history_voltage_add (&voltage, 100.0f, 25.0f, 8.4f);
+	up_history_voltage_add (&voltage, 100.0f, 25.0f, 8.2f);
+	up_history_voltage_add (&voltage, 0.0f, 25.0f, 6.0f);
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 100.0f, 100.0f, 25.0f, 7.4f), 8.3f, 0.0001f);
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 99.0f, 99.0f, 25.0f, 7.4f), 8.3f, 0.0001f);
+
+	/* the mean over a range uses the fallback where nothing is known */
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 0.0f, 5.0f, 25.0f, 7.4f), 6.7f, 0.0001f);
+
+	/* other temperatures are used until this one is learned, and an
+	 * unknown temperature is taken as room temperature */
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 0.0f, 0.0f, -10.0f, 7.4f), 6.0f, 0.0001f);
+	up_history_voltage_add (&voltage, 0.0f, -10.0f, 5.5f);
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 0.0f, 0.0f, -10.0f, 7.4f), 5.5f, 0.0001f);
+	g_assert_cmpfloat_with_epsilon (up_history_voltage_get_mean (&voltage, 0.0f, 0.0f, 0.0f, 7.4f), 6.0f, 0.0001f);
+	g_assert (voltage.dirty);
+
+	/* only a noticeable change needs saving */
+	up_history_voltage_mark_saved (&voltage);
+	g_assert (!voltage.dirty);
+	up_history_voltage_add (&voltage, 0.0f, -10.0f, 5.505f);
+	g_assert (!voltage.dirty);
+	up_history_voltage_add (&voltage, 0.0f, -10.0f, 6.5f);
+	g_assert (voltage.dirty);
+}
+
+static void
+up_test_history_codec_func (void)
+{
+	UpHistorySeries series;
+	UpHistorySeries decoded;
+	GByteArray *buf;
+	guint32 time_s = 1700000000;
+	const gint dods[] = { 63, 64, 65, 255, 256, 257, 2047, 2048, 2049 };
+	guint skipped = 0;
+	gboolean ret;
+	guint i;
+
+	up_history_series_init (&series);
+	up_history_series_init (&decoded);
+
+	/* regular samples, with a gap, a clock change and state changes */
+	for (i = 0; i < 1000; i++) {
+		time_s += (i % 10 == 0) ? 31 : 30;
+		if (i == 500)
+			time_s += 100000;
+		if (i == 600)
+			time_s -= 5000;
+		up_history_series_append (&series, time_s, 100.0f - i / 12.0f,
+					  (i / 300) % 2 ? UP_DEVICE_STATE_CHARGING : UP_DEVICE_STATE_DISCHARGING);
+	}
+
+	buf = g_byte_array_new ();
+	up_history_codec_encode (buf, &series, 0);
+	up_history_codec_encode (buf, &series, 990);
+	g_assert_cmpint (buf->len, <, series.len * 13 / 2);
+
+	ret = up_history_codec_decode (&decoded, buf->data, buf->len, 0, NULL);
+	g_assert (ret);
+	g_assert_cmpint (decoded.len, ==, 1010);
+	for (i = 0; i < decoded.len; i++) {
+		guint j = i < 1000 ? i : i - 10;
+
+		g_assert_cmpuint (up_history_series_get_time (&decoded, i), ==, up_history_series_get_time (&series, j));
+		g_assert_cmpfloat (up_history_series_get_value (&decoded, i), ==, up_history_series_get_value (&series, j));
+		g_assert_cmpint (up_history_series_get_state (&decoded, i), ==, up_history_series_get_state (&series, j));
+	}
+
+	/* old samples are skipped */
+	up_history_series_clear (&decoded);
+	ret = up_history_codec_decode (&decoded, buf->data, buf->len,
+				       up_history_series_get_time (&series, 100), &skipped);
+	g_assert (ret);
+	g_assert_cmpint (skipped, ==, 100);
+	g_assert_cmpint (decoded.len, ==, 910);
+
+	/* truncated data is detected */
+	ret = up_history_codec_decode (&decoded, buf->data, buf->len - 1, 0, NULL);
+	g_assert (!ret);
+
+	/* delta-of-deltas at the edges of each range, in both directions */
+	up_history_series_clear (&series);
+	up_history_series_clear (&decoded);
+	g_byte_array_set_size (buf, 0);
+	for (i = 0; i < G_N_ELEMENTS (dods) * 2; i++) {
+		gint dod = i % 2 ? -dods[i / 2] : dods[i / 2];
+
+		up_history_series_append (&series, time_s, 50, UP_DEVICE_STATE_CHARGING);
+		time_s += 3000 + dod;
+		up_history_series_append (&series, time_s, 50, UP_DEVICE_STATE_CHARGING);
+		time_s += 3000;
+	}
+	up_history_codec_encode (buf, &series, 0);
+	ret = up_history_codec_decode (&decoded, buf->data, buf->len, 0, NULL);
+	g_assert (ret);
+	g_assert_cmpint (decoded.len, ==, series.len);
+	for (i = 0; i < decoded.len; i++)
+		g_assert_cmpuint (up_history_series_get_time (&decoded, i), ==, up_history_series_get_time (&series, i));
+
+	g_byte_array_unref (buf);
+	up_history_series_clear (&series);
+	up_history_series_clear (&decoded);
+}
+
 static void
 up_test_history_func (void)
 {
@@ -142,6 +343,7 @@ up_test_history_func (void)
 	GPtrArray *array;
 	gchar *filename;
 	UpHistoryItem *item, *item2, *item3;
+	guint generation;
 
 	history = up_history_new ();
 	g_assert (history != NULL);
@@ -166,8 +368,12 @@ up_test_history_func (void)
 	g_ptr_array_unref (array);
 
 	/* setup some fake device and three data points */
+	generation = up_history_get_generation (history, UP_HISTORY_TYPE_CHARGE);
 	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpuint (up_history_get_generation (history, UP_HISTORY_TYPE_CHARGE), ==, generation);
 	up_history_set_charge_data (history, 85);
+	g_assert_cmpuint (up_history_get_generation (history, UP_HISTORY_TYPE_CHARGE), !=, generation);
+	g_assert_cmpint (up_history_get_data_expiry (history, UP_HISTORY_TYPE_CHARGE, 0), ==, G_MAXINT64);
 	up_history_set_rate_data (history, 0.99f);
 	up_history_set_time_empty_data (history, 12346);
 	up_history_set_time_full_data (history, 54322);
@@ -233,7 +439,7 @@ up_test_history_func (void)
 	g_object_unref (history);
 
 	/* ensure the file was created */
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-test.uph", NULL);
 	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
 	g_free (filename);
 
@@ -274,6 +480,732 @@ up_test_history_func (void)
 	rmdir (history_dir);
 }
 
+static void
+up_test_history_migrate_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *dir;
+	gchar *filename;
+	gchar *data;
+	gint64 now;
+	gboolean ret;
+	guint i;
+	guint found = 0;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* write two points in the legacy text format, after an expired point
+	 * and a corrupt line that are both skipped */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t90.000\tdischarging\n"
+				"garbage\t\n"
+				"%" G_GINT64_FORMAT "\t80.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t79.000\tdischarging\n",
+				now - 30 * 24 * 60 * 60, now - 3, now - 2);
+	filename = g_build_filename (dir, "history-charge-migrate.dat", NULL);
+	ret = g_file_set_contents (filename, data, -1, NULL);
+	g_assert (ret);
+	g_free (data);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "migrate");
+
+	/* the text file is replaced by the history file */
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	filename = g_build_filename (dir, "history-migrate.uph", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+	/* both points and the marker are there */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3);
+	for (i = 0; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		if (up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)
+			found++;
+	}
+	g_assert_cmpint (found, ==, 2);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_writer_func (void)
+{
+	UpHistoryWriter *writer;
+	UpHistory *history1;
+	UpHistory *history2;
+	gchar *dir;
+	gchar *filename1;
+	gchar *filename2;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename1 = g_build_filename (dir, "history-one.uph", NULL);
+	filename2 = g_build_filename (dir, "history-two.uph", NULL);
+
+	/* loading adds a marker, which is not saved right away */
+	history1 = up_history_new ();
+	up_history_set_directory (history1, dir);
+	up_history_set_id (history1, "one");
+	history2 = up_history_new ();
+	up_history_set_directory (history2, dir);
+	up_history_set_id (history2, "two");
+	g_assert (!g_file_test (filename1, G_FILE_TEST_EXISTS));
+	g_assert (!g_file_test (filename2, G_FILE_TEST_EXISTS));
+
+	/* both are saved in the same batch */
+	writer = up_history_writer_new ();
+	up_history_writer_flush (writer);
+	g_assert (g_file_test (filename1, G_FILE_TEST_EXISTS));
+	g_assert (g_file_test (filename2, G_FILE_TEST_EXISTS));
+	g_object_unref (writer);
+
+	g_object_unref (history1);
+	g_object_unref (history2);
+	g_unlink (filename1);
+	g_unlink (filename2);
+	g_free (filename1);
+	g_free (filename2);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_save_async_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	GMainLoop *loop = user_data;
+	GError *error = NULL;
+	gboolean ret;
+
+	ret = up_history_save_data_finish (UP_HISTORY (source_object), res, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_main_loop_quit (loop);
+}
+
+static void
+up_test_history_save_async_func (void)
+{
+	UpHistory *history;
+	GMainLoop *loop;
+	GPtrArray *array;
+	gchar *dir;
+	gchar *filename;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "history-async.uph", NULL);
+	loop = g_main_loop_new (NULL, FALSE);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "async");
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 85);
+
+	/* the second save waits for the first one */
+	up_history_save_data_async (history, NULL, up_test_history_save_async_cb, loop);
+	up_history_set_charge_data (history, 84);
+	up_history_save_data_async (history, NULL, up_test_history_save_async_cb, loop);
+	g_main_loop_run (loop);
+	g_main_loop_run (loop);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+	/* a synchronous save goes after the write in flight */
+	up_history_set_charge_data (history, 83);
+	up_history_save_data_async (history, NULL, up_test_history_save_async_cb, loop);
+	up_history_set_charge_data (history, 82);
+	g_assert (up_history_save_data (history));
+	g_main_loop_run (loop);
+	g_object_unref (history);
+
+	/* everything was written in order */
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "async");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, 6);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_main_loop_unref (loop);
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_journal_func (void)
+{
+	UpHistory *history;
+	UpHistoryItem *item;
+	GPtrArray *array;
+	GError *error = NULL;
+	gchar *dir;
+	gchar *filename;
+	gchar *journal;
+	gint64 time_now;
+	gint fd;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "history-journal.uph", NULL);
+	journal = g_build_filename (dir, "history-journal.journal", NULL);
+
+	/* samples left behind by a daemon that did not stop cleanly, after
+	 * one that is too old to be loaded */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	fd = up_history_journal_open (journal, &error);
+	g_assert_no_error (error);
+	g_assert (up_history_journal_append (fd, UP_HISTORY_TYPE_CHARGE, time_now - 30 * 24 * 60 * 60, 90,
+					     UP_DEVICE_STATE_DISCHARGING, NULL));
+	g_assert (up_history_journal_append (fd, UP_HISTORY_TYPE_CHARGE, time_now - 2, 85,
+					     UP_DEVICE_STATE_DISCHARGING, NULL));
+	g_assert (up_history_journal_append (fd, UP_HISTORY_TYPE_CHARGE, time_now - 1, 84,
+					     UP_DEVICE_STATE_DISCHARGING, NULL));
+	close (fd);
+
+	/* they are replayed before the marker */
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_journal_directory (history, dir);
+	up_history_set_id (history, "journal");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, 3);
+	item = (UpHistoryItem *) g_ptr_array_index (array, 1);
+	g_assert_cmpint (up_history_item_get_value (item), ==, 84);
+	g_ptr_array_unref (array);
+
+	/* everything is in the file after a clean stop */
+	g_object_unref (history);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_assert (!g_file_test (journal, G_FILE_TEST_EXISTS));
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_journal_directory (history, dir);
+	up_history_set_id (history, "journal");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, 4);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_unlink (filename);
+	g_unlink (journal);
+	g_free (filename);
+	g_free (journal);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_limits_func (void)
+{
+	UpHistory *history;
+	UpHistoryItem *item;
+	GPtrArray *array;
+	gchar *dir;
+	gchar *filename;
+	guint generation;
+	guint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "history-limits.uph", NULL);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "limits");
+	up_history_set_max_samples (history, 8, 100);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	for (i = 0; i < 10; i++)
+		up_history_set_charge_data (history, 100 - i);
+
+	/* the limit holds before anything is saved, the marker is kept and
+	 * the oldest samples are merged in pairs */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, 8);
+	item = g_ptr_array_index (array, 0);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_UNKNOWN);
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 97.875);
+	item = g_ptr_array_index (array, 7);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 91);
+	g_ptr_array_unref (array);
+	g_assert (up_history_save_data (history));
+
+	/* and once the samples are saved */
+	generation = up_history_get_generation (history, UP_HISTORY_TYPE_CHARGE);
+	up_history_set_charge_data (history, 90);
+	g_assert_cmpuint (up_history_get_generation (history, UP_HISTORY_TYPE_CHARGE), >, generation + 1);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, 8);
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 96.9375);
+	item = g_ptr_array_index (array, 7);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 90);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_budget_func (void)
+{
+	UpHistory *history_a;
+	UpHistory *history_b;
+	GPtrArray *array;
+	gchar *dir;
+	gchar *filename_a;
+	gchar *filename_b;
+	guint generation;
+	guint len;
+	guint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename_a = g_build_filename (dir, "history-budget-a.uph", NULL);
+	filename_b = g_build_filename (dir, "history-budget-b.uph", NULL);
+
+	/* two histories sharing a budget of 16 samples */
+	history_a = up_history_new ();
+	up_history_set_directory (history_a, dir);
+	up_history_set_id (history_a, "budget-a");
+	up_history_set_max_samples (history_a, 1000, 1000);
+	up_history_set_max_total_samples (history_a, 16);
+	up_history_set_state (history_a, UP_DEVICE_STATE_DISCHARGING);
+	for (i = 0; i < 10; i++)
+		up_history_set_charge_data (history_a, 100 - i);
+	g_assert (up_history_save_data (history_a));
+
+	history_b = up_history_new ();
+	up_history_set_directory (history_b, dir);
+	up_history_set_id (history_b, "budget-b");
+	up_history_set_max_samples (history_b, 1000, 1000);
+	up_history_set_max_total_samples (history_b, 16);
+	up_history_set_state (history_b, UP_DEVICE_STATE_DISCHARGING);
+	for (i = 0; i < 10; i++)
+		up_history_set_charge_data (history_b, 100 - i);
+	g_assert (up_history_save_data (history_b));
+
+	/* over the budget, the history bigger than its half is downsampled */
+	generation = up_history_get_generation (history_b, UP_HISTORY_TYPE_CHARGE);
+	up_history_set_charge_data (history_b, 80);
+	g_assert_cmpuint (up_history_get_generation (history_b, UP_HISTORY_TYPE_CHARGE), >, generation + 1);
+	array = up_history_get_data (history_b, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	len = array->len;
+	g_assert_cmpint (len, <, 12);
+	g_ptr_array_unref (array);
+	g_assert (up_history_save_data (history_b));
+
+	/* the samples of a finalized history are no longer counted */
+	g_object_unref (history_a);
+	generation = up_history_get_generation (history_b, UP_HISTORY_TYPE_CHARGE);
+	for (i = 0; i < 4; i++)
+		up_history_set_charge_data (history_b, 79 - i);
+	g_assert_cmpuint (up_history_get_generation (history_b, UP_HISTORY_TYPE_CHARGE), ==, generation + 4);
+	array = up_history_get_data (history_b, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert_cmpint (array->len, ==, len + 4);
+	g_ptr_array_unref (array);
+	g_object_unref (history_b);
+
+	g_unlink (filename_a);
+	g_unlink (filename_b);
+	g_free (filename_a);
+	g_free (filename_b);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_tolerance_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	gchar *dir;
+	gchar *filename;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "history-tolerance.uph", NULL);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "tolerance");
+	up_history_set_tolerance (history, UP_HISTORY_TYPE_RATE, 0.5, 10);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+
+	/* changes within 10% of the last recorded sample are skipped */
+	g_assert (up_history_set_rate_data (history, 10.0));
+	g_assert (!up_history_set_rate_data (history, 10.4));
+	g_assert (!up_history_set_rate_data (history, 10.9));
+	g_assert (up_history_set_rate_data (history, 11.5));
+
+	/* a state change is always recorded */
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	g_assert (up_history_set_rate_data (history, 11.6));
+
+	array = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 100);
+	g_assert_cmpint (array->len, ==, 4);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static gdouble
+up_test_history_get_max_value (GPtrArray *array)
+{
+	gdouble max = 0.f;
+	guint i;
+
+	for (i = 0; i < array->len; i++) {
+		UpHistoryItem *item = g_ptr_array_index (array, i);
+		max = MAX (max, up_history_item_get_value (item));
+	}
+	return max;
+}
+
+static void
+up_test_history_downsample_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	GString *data;
+	gchar *dir;
+	gchar *filename;
+	gint64 now;
+	gboolean ret;
+	guint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* a flat rate with a single short peak */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%.3f\tdischarging\n",
+					now - 200 + i, i == 37 ? 50.f : 10.f);
+	filename = g_build_filename (dir, "history-rate-downsample.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	g_string_free (data, TRUE);
+	g_free (filename);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "downsample");
+	g_assert_cmpint (up_history_resolution_mode_from_string ("bogus"), ==, UP_HISTORY_RESOLUTION_MODE_UNKNOWN);
+
+	/* averaging flattens the peak */
+	array = up_history_get_data_full (history, UP_HISTORY_TYPE_RATE, 0, 10,
+					  UP_HISTORY_RESOLUTION_MODE_AVERAGE);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), <, 50.f);
+	g_ptr_array_unref (array);
+
+	/* the shape preserving modes keep it */
+	array = up_history_get_data_full (history, UP_HISTORY_TYPE_RATE, 0, 10,
+					  UP_HISTORY_RESOLUTION_MODE_LTTB);
+	g_assert_cmpint (array->len, ==, 10);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), ==, 50.f);
+	g_assert_cmpint (up_history_item_get_time (g_ptr_array_index (array, array->len - 1)), >=, now);
+	g_ptr_array_unref (array);
+	array = up_history_get_data_full (history, UP_HISTORY_TYPE_RATE, 0, 10,
+					  UP_HISTORY_RESOLUTION_MODE_MINMAX);
+	g_assert_cmpint (array->len, <=, 10);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), ==, 50.f);
+	g_assert_cmpint (up_history_item_get_time (g_ptr_array_index (array, array->len - 1)), >=, now);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	filename = g_build_filename (dir, "history-downsample.uph", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_range_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	GString *data;
+	gchar *dir;
+	gchar *filename;
+	gint64 now;
+	guint32 next;
+	gboolean ret;
+	guint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* two samples share a second */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i < 5; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%u.000\tdischarging\n", now - 100 + i, 90 - i);
+	g_string_append_printf (data, "%" G_GINT64_FORMAT "\t85.000\tcharging\n", now - 95);
+	g_string_append_printf (data, "%" G_GINT64_FORMAT "\t86.000\tcharging\n", now - 95);
+	for (i = 0; i < 3; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%u.000\tdischarging\n", now - 90 + i, 84 - i);
+	filename = g_build_filename (dir, "history-charge-range.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	g_string_free (data, TRUE);
+	g_free (filename);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "range");
+
+	/* the oldest samples come first */
+	array = up_history_get_range (history, UP_HISTORY_TYPE_CHARGE, 0, 0, 4, UP_DEVICE_STATE_UNKNOWN, &next);
+	g_assert_cmpint (array->len, ==, 4);
+	g_assert_cmpfloat (up_history_item_get_value (g_ptr_array_index (array, 0)), ==, 90);
+	g_assert_cmpint (next, ==, now - 96);
+	g_ptr_array_unref (array);
+
+	/* a page does not split a second ... */
+	array = up_history_get_range (history, UP_HISTORY_TYPE_CHARGE, next, 0, 2, UP_DEVICE_STATE_UNKNOWN, &next);
+	g_assert_cmpint (array->len, ==, 1);
+	g_assert_cmpint (next, ==, now - 95);
+	g_ptr_array_unref (array);
+
+	/* ... unless the second is all there is */
+	array = up_history_get_range (history, UP_HISTORY_TYPE_CHARGE, next, 0, 1, UP_DEVICE_STATE_UNKNOWN, &next);
+	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpint (next, ==, now - 90);
+	g_ptr_array_unref (array);
+
+	/* the end is exclusive */
+	array = up_history_get_range (history, UP_HISTORY_TYPE_CHARGE, 0, now - 95, 0, UP_DEVICE_STATE_UNKNOWN, &next);
+	g_assert_cmpint (array->len, ==, 5);
+	g_assert_cmpint (next, ==, 0);
+	g_ptr_array_unref (array);
+
+	/* only the samples in the state */
+	array = up_history_get_range (history, UP_HISTORY_TYPE_CHARGE, 0, 0, 0, UP_DEVICE_STATE_CHARGING, &next);
+	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpint (next, ==, 0);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	filename = g_build_filename (dir, "history-range.uph", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_multi_func (void)
+{
+	UpHistory *history;
+	GPtrArray *result;
+	GPtrArray *array;
+	GString *data;
+	gchar *dir;
+	gchar *filename;
+	gint64 now;
+	gboolean ret;
+	guint i;
+	const UpHistoryType types[] = { UP_HISTORY_TYPE_CHARGE,
+					UP_HISTORY_TYPE_RATE,
+					UP_HISTORY_TYPE_TIME_FULL };
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* the rate only covers the second half of the charge data */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%u.000\tdischarging\n", now - 200 + i, 100 - i);
+	filename = g_build_filename (dir, "history-charge-multi.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	g_free (filename);
+	g_string_truncate (data, 0);
+	for (i = 50; i < 100; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t10.000\tdischarging\n", now - 200 + i);
+	filename = g_build_filename (dir, "history-rate-multi.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	g_free (filename);
+	g_string_free (data, TRUE);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "multi");
+
+	result = up_history_get_data_multi (history, types, G_N_ELEMENTS (types), 0, 10);
+	g_assert_cmpint (result->len, ==, 3);
+
+	/* the charge data spans the whole range */
+	array = g_ptr_array_index (result, 0);
+	g_assert_cmpint (array->len, >, 2);
+	g_assert_cmpint (array->len, <=, 10);
+
+	/* the rate uses the same buckets, so fewer of them */
+	g_assert_cmpint (((GPtrArray *) g_ptr_array_index (result, 1))->len, <, array->len);
+
+	/* only the marker */
+	g_assert_cmpint (((GPtrArray *) g_ptr_array_index (result, 2))->len, ==, 1);
+	g_ptr_array_unref (result);
+	g_object_unref (history);
+
+	filename = g_build_filename (dir, "history-multi.uph", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_transitions_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *dir;
+	gchar *filename;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "history-transitions.uph", NULL);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "transitions");
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 90);
+	up_history_set_charge_data (history, 89);
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	up_history_set_charge_data (history, 91);
+	up_history_set_state (history, UP_DEVICE_STATE_FULLY_CHARGED);
+	up_history_set_charge_data (history, 100);
+
+	/* the marker and repeated states are not transitions */
+	array = up_history_get_transitions (history, 0, 0);
+	g_assert_cmpint (array->len, ==, 3);
+	item = g_ptr_array_index (array, 0);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_DISCHARGING);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 90);
+	item = g_ptr_array_index (array, 2);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_FULLY_CHARGED);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	/* the index is saved with the data */
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "transitions");
+	array = up_history_get_transitions (history, 0, 0);
+	g_assert_cmpint (array->len, ==, 3);
+	g_ptr_array_unref (array);
+	array = up_history_get_transitions (history, g_get_real_time () / G_USEC_PER_SEC + 1, 0);
+	g_assert_cmpint (array->len, ==, 0);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
+static void
+up_test_history_statistics_func (void)
+{
+	UpHistory *history;
+	UpHistoryStatisticsBin *bin;
+	GArray *bins;
+	GString *data;
+	gchar *dir;
+	gchar *filename;
+	gint64 now;
+	gboolean ret;
+	guint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* a percentage point every minute, then every two minutes */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i <= 10; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%u.000\tdischarging\n",
+					now - 2000 + (i <= 5 ? i * 60 : 300 + (i - 5) * 120), 90 - i);
+	filename = g_build_filename (dir, "history-charge-statistics.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	g_string_free (data, TRUE);
+	g_free (filename);
+
+	history = up_history_new ();
+	up_history_set_directory (history, dir);
+	up_history_set_id (history, "statistics");
+
+	bins = up_history_get_statistics (history, FALSE, 10, 3600);
+	g_assert_cmpint (bins->len, ==, 11);
+	bin = &g_array_index (bins, UpHistoryStatisticsBin, 8);
+	g_assert_cmpint (bin->percentage, ==, 80);
+	g_assert_cmpint (bin->count, ==, 10);
+	g_assert_cmpfloat (bin->mean, ==, 90.f);
+	g_assert_cmpfloat_with_epsilon (bin->variance, 900.f, 0.001f);
+	bin = &g_array_index (bins, UpHistoryStatisticsBin, 9);
+	g_assert_cmpint (bin->count, ==, 0);
+	g_array_unref (bins);
+
+	/* nothing charging */
+	bins = up_history_get_statistics (history, TRUE, 5, 0);
+	g_assert_cmpint (bins->len, ==, 21);
+	for (i = 0; i < bins->len; i++)
+		g_assert_cmpint (g_array_index (bins, UpHistoryStatisticsBin, i).count, ==, 0);
+	g_array_unref (bins);
+	g_object_unref (history);
+
+	filename = g_build_filename (dir, "history-statistics.uph", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	rmdir (dir);
+	g_free (dir);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -283,12 +1215,29 @@ main (int argc, char **argv)
 	g_test_init (&argc, &argv, NULL);
 
 	g_setenv ("UPOWER_CONF_FILE_NAME", UPOWER_CONF_PATH, TRUE);
+	g_setenv ("UPOWER_HISTORY_JOURNAL_DIR", g_get_tmp_dir (), TRUE);
 
 	/* tests go here */
 	g_test_add_func ("/power/backend", up_test_backend_func);
 	g_test_add_func ("/power/device", up_test_device_func);
 	g_test_add_func ("/power/device_list", up_test_device_list_func);
 	g_test_add_func ("/power/history", up_test_history_func);
+	g_test_add_func ("/power/history_migrate", up_test_history_migrate_func);
+	g_test_add_func ("/power/history_rollup", up_test_history_rollup_func);
+	g_test_add_func ("/power/history_profile", up_test_history_profile_func);
+	g_test_add_func ("/power/history_voltage", up_test_history_voltage_func);
+	g_test_add_func ("/power/history_codec", up_test_history_codec_func);
+	g_test_add_func ("/power/history_writer", up_test_history_writer_func);
+	g_test_add_func ("/power/history_save_async", up_test_history_save_async_func);
+	g_test_add_func ("/power/history_journal", up_test_history_journal_func);
+	g_test_add_func ("/power/history_limits", up_test_history_limits_func);
+	g_test_add_func ("/power/history_budget", up_test_history_budget_func);
+	g_test_add_func ("/power/history_tolerance", up_test_history_tolerance_func);
+	g_test_add_func ("/power/history_downsample", up_test_history_downsample_func);
+	g_test_add_func ("/power/history_range", up_test_history_range_func);
+	g_test_add_func ("/power/history_multi", up_test_history_multi_func);
+	g_test_add_func ("/power/history_transitions", up_test_history_transitions_func);
+	g_test_add_func ("/power/history_statistics", up_test_history_statistics_func);
 	g_test_add_func ("/power/native", up_test_native_func);
 	g_test_add_func ("/power/daemon", up_test_daemon_func);
 